@@ -0,0 +1,604 @@
+#include "cache_core.hxx"
+#include "locate_pattern.hxx"
+#include "path_pool.hxx"
+#include "query.hxx"
+#include "use_locate.hxx"
+
+#include <algorithm>
+#include <atomic>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <new>
+#include <random>
+#include <string>
+#include <string_view>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/resource.h>
+#include <unistd.h>
+
+/* counting the allocations of all threads */
+
+static std::atomic<std::uint64_t> allocation_count = 0;
+
+void *operator new(std::size_t size)
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	void *p = std::malloc((size == 0) ? 1 : size);
+	if(p == nullptr) throw std::bad_alloc();
+	return p;
+}
+
+void *operator new(std::size_t size, std::nothrow_t const &) noexcept
+{
+	allocation_count.fetch_add(1, std::memory_order_relaxed);
+	return std::malloc((size == 0) ? 1 : size);
+}
+
+/* not inlined, as the pointer from operator new is passed to free */
+[[gnu::noinline]] void operator delete(void *p) noexcept
+{
+	std::free(p);
+}
+
+[[gnu::noinline]] void operator delete(void *p, std::size_t) noexcept
+{
+	std::free(p);
+}
+
+/* the synthetic corpus */
+/* The paths are made by a fixed generator from the seed, so the same
+   options make the same corpus on any machine. */
+
+static char const * const syllables[] = {
+	"ad", "con", "da", "doc", "fig", "ka", "lib", "lo", "me", "mi", "pho", "re",
+	"src", "ta", "tes", "to"
+};
+
+static char const * const unicode_names[] = {
+	"résumé", "日本語", "Ωmega", "naïve",
+	"фото", "한국어", "emoji_\U0001f600",
+	"Straße"
+};
+
+static char const * const extensions[] = {
+	"", ".cxx", ".hxx", ".jpg", ".md", ".pdf", ".png", ".tar.gz", ".txt"
+};
+
+template<class T, std::size_t N>
+static T const &pick(std::mt19937_64 *rng, T const (&x)[N])
+{
+	return x[(*rng)() % N];
+}
+
+static std::string make_name(std::mt19937_64 *rng)
+{
+	std::string result;
+	if((*rng)() % 16 == 0){
+		result.push_back('.'); /* hidden */
+	}
+	if((*rng)() % 12 == 0){
+		result.append(pick(rng, unicode_names));
+	}else{
+		std::size_t n = 1 + (*rng)() % 3;
+		for(std::size_t i = 0; i < n; ++ i){
+			result.append(pick(rng, syllables));
+		}
+	}
+	if((*rng)() % 4 == 0){
+		result.append(std::to_string((*rng)() % 100));
+	}
+	return result;
+}
+
+/* the directories and files under root in the order of the database */
+static void generate_tree(
+	std::mt19937_64 *rng, std::string const &root, std::size_t count,
+	std::size_t max_depth, std::vector<std::string> *result
+)
+{
+	std::vector<std::string> stack{root};
+	result->push_back(root);
+	for(std::size_t n = 1; n < count; ){
+		unsigned r = (*rng)() % 16;
+		if(r < 3 && stack.size() < max_depth){
+			stack.push_back(stack.back() + '/' + make_name(rng));
+			result->push_back(stack.back());
+			++ n;
+		}else if(r < 5 && stack.size() > 1){
+			stack.pop_back();
+		}else{
+			result->push_back(stack.back() + '/' + make_name(rng) + pick(rng, extensions));
+			++ n;
+		}
+	}
+}
+
+static void generate_corpus(
+	std::size_t count, std::uint64_t seed, std::string const &home,
+	std::vector<std::string> *result
+)
+{
+	std::mt19937_64 rng(seed);
+	std::size_t in_home = count / 2;
+	generate_tree(&rng, "/opt/bench", count / 4, 12, result);
+	generate_tree(&rng, home, in_home, 16, result);
+	generate_tree(&rng, "/usr/share/bench", count - count / 4 - in_home, 8, result);
+}
+
+/* closing fd */
+static int write_corpus(int fd, std::vector<std::string> const *corpus)
+{
+	std::FILE *file = fdopen(fd, "wb");
+	if(file == nullptr){
+		int error = nonzero_errno(errno);
+		close(fd);
+		return error;
+	}
+	for(
+		std::vector<std::string>::const_iterator i = corpus->cbegin();
+		i != corpus->cend();
+		++ i
+	){
+		std::fwrite(i->data(), 1, i->size() + 1, file); /* with NUL */
+	}
+	int error = std::ferror(file) ? EIO : 0;
+	if(std::fclose(file) != 0 && error == 0){
+		error = nonzero_errno(errno);
+	}
+	return error;
+}
+
+/* the fake locate */
+/* While BENCH_LOCATE_CORPUS is set, this program replays the corpus
+   like "locate -0 [-b] [-i] -l limit -- pattern", so the benchmark runs
+   without the database. */
+
+static char const corpus_variable[] = "BENCH_LOCATE_CORPUS";
+
+static int fake_locate(char const *corpus_path, int argc, char const * const *argv)
+{
+	using namespace std::string_view_literals;
+	
+	bool base_name = false;
+	bool ignore_case = false;
+	std::size_t limit = default_locate_limit;
+	int i = 1;
+	while(i < argc){
+		std::string_view e(argv[i]);
+		if(e == "-0"sv){
+			++ i;
+		}else if(e == "-b"sv){
+			++ i;
+			base_name = true;
+		}else if(e == "-i"sv){
+			++ i;
+			ignore_case = true;
+		}else if(e == "-l"sv && i + 1 < argc){
+			std::string_view value(argv[i + 1]);
+			std::from_chars(value.data(), value.data() + value.size(), limit);
+			i += 2;
+		}else if(e == "--"sv){
+			++ i;
+			break;
+		}else{
+			break;
+		}
+	}
+	if(i + 1 != argc) return 2;
+	locate_pattern_t pattern;
+	compile_locate_pattern(std::string_view(argv[i]), base_name, ignore_case, &pattern);
+	
+	std::FILE *file = std::fopen(corpus_path, "rb");
+	if(file == nullptr) return 1;
+	std::string corpus;
+	char buffer[0x10000];
+	std::size_t r;
+	while((r = std::fread(buffer, 1, sizeof(buffer), file)) > 0){
+		corpus.append(buffer, r);
+	}
+	std::fclose(file);
+	
+	std::size_t n = 0;
+	std::size_t start = 0;
+	std::size_t nul;
+	while(n < limit && (nul = corpus.find('\0', start)) != std::string::npos){
+		std::string_view item(corpus.data() + start, nul - start);
+		if(match_locate_pattern(item, &pattern)){
+			std::fwrite(item.data(), 1, item.size() + 1, stdout);
+			++ n;
+		}
+		start = nul + 1;
+	}
+	return (std::fflush(stdout) != 0) ? 1 : 0;
+}
+
+/* measuring */
+
+enum stage_t {st_spawn, st_read, st_match, st_stat, st_sort, st_total, stage_count};
+
+static char const * const stage_names[stage_count] = {
+	"spawn", "read", "match", "stat", "sort", "total"
+};
+
+struct stage_stats_t {
+	std::vector<double> seconds; /* of each query */
+	std::uint64_t items;
+	std::uint64_t allocations;
+	long max_rss; /* KiB, at the end of the stage */
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+struct stage_timer_t {
+	stage_stats_t *stats;
+	bench_clock::time_point start;
+	std::uint64_t start_allocations;
+};
+
+static stage_timer_t start_stage(stage_stats_t *stats)
+{
+	return stage_timer_t{
+		stats, bench_clock::now(), allocation_count.load(std::memory_order_relaxed)
+	};
+}
+
+static void finish_stage(stage_timer_t const *timer, std::uint64_t items)
+{
+	std::chrono::duration<double> elapsed = bench_clock::now() - timer->start;
+	stage_stats_t *stats = timer->stats;
+	stats->seconds.push_back(elapsed.count());
+	stats->items += items;
+	stats->allocations +=
+		allocation_count.load(std::memory_order_relaxed) - timer->start_allocations;
+	struct rusage usage;
+	if(getrusage(RUSAGE_SELF, &usage) == 0){
+		stats->max_rss = std::max(stats->max_rss, usage.ru_maxrss);
+	}
+}
+
+/* nearest rank */
+static double percentile(std::vector<double> const *sorted, std::size_t p)
+{
+	if(sorted->empty()) return 0.;
+	std::size_t rank = (sorted->size() * p + 99) / 100;
+	return (*sorted)[std::max(rank, std::size_t{1}) - 1];
+}
+
+static void report(stage_stats_t *stats, std::size_t queries)
+{
+	std::printf(
+		"%-6s %8s %10s %10s %12s %10s %10s\n",
+		"stage", "runs", "p50 ms", "p99 ms", "items/s", "allocs/q", "RSS KiB"
+	);
+	for(int i = 0; i < stage_count; ++ i){
+		stage_stats_t *s = &stats[i];
+		if(s->seconds.empty()) continue;
+		double sum = 0.;
+		for(
+			std::vector<double>::const_iterator j = s->seconds.cbegin();
+			j != s->seconds.cend();
+			++ j
+		){
+			sum += *j;
+		}
+		std::sort(s->seconds.begin(), s->seconds.end());
+		std::printf(
+			"%-6s %8zu %10.3f %10.3f %12.0f %10.1f %10ld\n",
+			stage_names[i], s->seconds.size(),
+			percentile(&s->seconds, 50) * 1e3, percentile(&s->seconds, 99) * 1e3,
+			(sum > 0.) ? s->items / sum : 0.,
+			static_cast<double>(s->allocations) / queries,
+			s->max_rss
+		);
+	}
+	struct rusage usage;
+	if(getrusage(RUSAGE_CHILDREN, &usage) == 0){
+		std::printf("locate max RSS: %ld KiB\n", usage.ru_maxrss);
+	}
+}
+
+/* replaying */
+
+/* running one query as match() does, without the caches and the display */
+static int run_query(
+	query_t const *query, char const *locate_path, std::size_t limit,
+	std::size_t match_limit, bool in_process, home_paths_t const *home,
+	path_pool_t *paths, stage_stats_t *stats, std::uint64_t *passed
+)
+{
+	locate_query_t const *locate_query = &query->locate_query;
+	std::vector<path_id_t> located;
+	bool dropped = false;
+	auto f = [paths, &located, &dropped](std::string_view item){
+		path_id_t path;
+		if(paths->intern(item, &path) != 0){
+			dropped = true;
+		}else{
+			located.push_back(path);
+		}
+		return 0;
+	};
+	auto cancelled = [](){ return false; };
+	
+	int error;
+	stage_timer_t total = start_stage(&stats[st_total]);
+	if(in_process){
+		stage_timer_t timer = start_stage(&stats[st_read]);
+		int status;
+		error = locate_in_process(
+			locate_query->pattern, locate_query->base_name, locate_query->ignore_case,
+			limit, make_locate_callback(f), make_locate_cancelled(cancelled), &status
+		);
+		if(error != 0) return error;
+		finish_stage(&timer, located.size());
+	}else{
+		stage_timer_t timer = start_stage(&stats[st_spawn]);
+		locate_command_t command;
+		if(
+			(error =
+				spawn_locate_command(
+					locate_path, locate_query->pattern, locate_query->base_name,
+					locate_query->ignore_case, limit, &command
+				)) != 0
+		){
+			return error;
+		}
+		finish_stage(&timer, 1);
+		timer = start_stage(&stats[st_read]);
+		error = read_0(&command, f, cancelled);
+		int status;
+		error =
+			wait_locate_command(&command, error, make_locate_cancelled(cancelled), &status);
+		if(error != 0) return error;
+		finish_stage(&timer, located.size());
+	}
+	
+	stage_timer_t timer = start_stage(&stats[st_match]);
+	std::vector<path_id_t> matched_paths;
+	std::vector<std::string_view> matched;
+	for(
+		std::vector<path_id_t>::const_iterator i = located.cbegin();
+		i != located.cend();
+		++ i
+	){
+		std::string_view item = paths->get(*i);
+		if(match_query(item, query)){
+			matched_paths.push_back(*i);
+			matched.push_back(item);
+		}
+	}
+	finish_stage(&timer, located.size());
+	
+	timer = start_stage(&stats[st_stat]);
+	std::vector<file_kind_t> kinds(matched.size());
+	stat_items(matched.data(), matched.size(), kinds.data());
+	for(
+		std::vector<file_kind_t>::const_iterator i = kinds.cbegin();
+		i != kinds.cend();
+		++ i
+	){
+		if(filter_file_kind(*i, query)){
+			++ *passed;
+		}
+	}
+	finish_stage(&timer, matched.size());
+	
+	/* the sort keys and lt() as the plugin, for all the matched ones since
+	   the paths of the synthetic corpus do not exist */
+	timer = start_stage(&stats[st_sort]);
+	queried_t queried;
+	queried.list.reserve(matched.size());
+	for(std::size_t i = 0; i < matched.size(); ++ i){
+		queried.list.push_back(
+			make_ranked(paths, home, matched_paths[i], kinds[i] == fk_directory, i)
+		);
+	}
+	queried.sorted_length = 0;
+	rank(&queried, match_limit);
+	finish_stage(&timer, matched.size());
+	finish_stage(&total, 1);
+	return dropped ? ENOMEM : 0;
+}
+
+/* the queries while typing each sequence, from 2 letters as KRunner */
+static void expand_keystrokes(
+	std::vector<std::string> const *sequences, std::vector<std::string> *result
+)
+{
+	for(
+		std::vector<std::string>::const_iterator i = sequences->cbegin();
+		i != sequences->cend();
+		++ i
+	){
+		for(std::size_t n = 2; n <= i->size(); ++ n){
+			result->push_back(i->substr(0, n));
+		}
+	}
+}
+
+static int read_lines(char const *path, std::vector<std::string> *result)
+{
+	std::FILE *file = std::fopen(path, "r");
+	if(file == nullptr) return nonzero_errno(errno);
+	std::string line;
+	int c;
+	while((c = std::fgetc(file)) != EOF){
+		if(c == '\n'){
+			if(! line.empty()) result->push_back(std::move(line));
+			line.clear();
+		}else{
+			line.push_back(static_cast<char>(c));
+		}
+	}
+	if(! line.empty()) result->push_back(std::move(line));
+	std::fclose(file);
+	return 0;
+}
+
+static bool parse_size(char const *image, std::size_t *result)
+{
+	std::string_view value(image);
+	std::from_chars_result r =
+		std::from_chars(value.data(), value.data() + value.size(), *result);
+	return r.ec == std::errc() && r.ptr == value.data() + value.size();
+}
+
+int main(int argc, char const * const *argv)
+{
+	using namespace std::string_view_literals;
+	
+	if(char const *corpus_path = std::getenv(corpus_variable); corpus_path != nullptr){
+		return fake_locate(corpus_path, argc, argv);
+	}
+	
+	std::size_t path_count = 200000;
+	std::size_t seed = 1;
+	std::size_t limit = default_locate_limit;
+	std::size_t match_limit = 100;
+	std::size_t repeat = 3;
+	std::string home = "/home/bench";
+	char const *corpus_path = nullptr;
+	char const *keys_path = nullptr;
+	char const *locate_path = "/proc/self/exe";
+	bool fake = true;
+	bool in_process = false;
+	int i = 1;
+	while(i < argc){
+		std::string_view e(argv[i]);
+		if(
+			(
+				e == "--paths"sv || e == "--seed"sv || e == "--limit"sv
+				|| e == "--matches"sv || e == "--repeat"sv
+			)
+			&& i + 1 < argc
+		){
+			std::size_t *value =
+				(e == "--paths"sv) ? &path_count :
+				(e == "--seed"sv) ? &seed :
+				(e == "--limit"sv) ? &limit :
+				(e == "--matches"sv) ? &match_limit :
+				&repeat;
+			if(! parse_size(argv[i + 1], value) || (value != &seed && *value == 0)){
+				std::fprintf(stderr, "%s: invalid value: %s\n", argv[0], argv[i + 1]);
+				return 2;
+			}
+			i += 2;
+		}else if(e == "--home"sv && i + 1 < argc){
+			home = argv[i + 1];
+			i += 2;
+		}else if(e == "--corpus"sv && i + 1 < argc){
+			corpus_path = argv[i + 1];
+			i += 2;
+		}else if(e == "--keys"sv && i + 1 < argc){
+			keys_path = argv[i + 1];
+			i += 2;
+		}else if(e == "--locate"sv && i + 1 < argc){
+			locate_path = argv[i + 1];
+			fake = false;
+			i += 2;
+		}else if(e == "--in-process"sv){
+			++ i;
+			fake = false;
+			in_process = true;
+		}else if(e == "--"sv){
+			++ i;
+			break;
+		}else if(e.size() > 0 && e[0] == '-'){
+			std::fprintf(stderr, "%s: unknown option: %s\n", argv[0], argv[i]);
+			return 2;
+		}else{
+			break;
+		}
+	}
+	
+	/* the typed sequences */
+	std::vector<std::string> sequences(argv + i, argv + argc);
+	if(keys_path != nullptr){
+		int error = read_lines(keys_path, &sequences);
+		if(error != 0){
+			std::fprintf(stderr, "%s: %s: %s\n", argv[0], keys_path, std::strerror(error));
+			return EXIT_FAILURE;
+		}
+	}
+	if(sequences.empty()){
+		sequences = {"readme", "*.pdf", "src/lib", "/opt/bench/con", "日本", "Resume"};
+	}
+	std::vector<std::string> queries;
+	expand_keystrokes(&sequences, &queries);
+	
+	/* the corpus for the fake locate */
+	std::string temporary;
+	if(fake){
+		std::vector<std::string> corpus;
+		generate_corpus(path_count, seed, home, &corpus);
+		int fd;
+		if(corpus_path == nullptr){
+			/* a new file, not following a link made by the others */
+			char const *directory = std::getenv("TMPDIR");
+			temporary = (directory != nullptr) ? directory : "/tmp";
+			temporary.append("/bench_locate.XXXXXX");
+			fd = mkostemp(temporary.data(), O_CLOEXEC);
+			corpus_path = temporary.c_str();
+		}else{
+			fd = open(corpus_path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+		}
+		int error = (fd < 0) ? nonzero_errno(errno) : write_corpus(fd, &corpus);
+		if(error != 0){
+			if(! temporary.empty() && fd >= 0){
+				unlink(temporary.c_str());
+			}
+			std::fprintf(stderr, "%s: %s: %s\n", argv[0], corpus_path, std::strerror(error));
+			return EXIT_FAILURE;
+		}
+		setenv(corpus_variable, corpus_path, 1); /* for the children */
+		std::printf("corpus: %zu paths, seed %zu, %s\n", corpus.size(), seed, corpus_path);
+	}
+	
+	home_paths_t home_paths;
+	setup_home_paths(home.c_str(), &home_paths);
+	stage_stats_t stats[stage_count] = {};
+	std::uint64_t passed = 0; /* by stat */
+	path_pool_t paths; /* shared by the queries, as a cache */
+	int error = 0;
+	for(std::size_t r = 0; r < repeat && error == 0; ++ r){
+		for(
+			std::vector<std::string>::const_iterator j = queries.cbegin();
+			j != queries.cend() && error == 0;
+			++ j
+		){
+			query_t query;
+			parse_query(*j, &query);
+			error = run_query(
+				&query, locate_path, limit, match_limit, in_process, &home_paths, &paths,
+				stats, &passed
+			);
+			if(error == EUNSUPPORTED_DATABASE){
+				std::fprintf(stderr, "%s: could not read any database.\n", argv[0]);
+			}else if(error != 0){
+				std::fprintf(
+					stderr, "%s: %s: %s\n", argv[0], j->c_str(), std::strerror(error)
+				);
+			}
+		}
+	}
+	if(! temporary.empty()){
+		unlink(temporary.c_str());
+	}
+	if(error != 0) return EXIT_FAILURE;
+	
+	std::printf(
+		"queries: %zu x %zu, limit %zu, matches %zu, passed %llu paths, "
+			"interned %zu paths (%zu bytes)\n",
+		queries.size(), repeat, limit, match_limit,
+		static_cast<unsigned long long>(passed),
+		paths.size(), paths.memory_size()
+	);
+	report(stats, queries.size() * repeat);
+	return EXIT_SUCCESS;
+}
@@ -0,0 +1,841 @@
+#include "cache_core.hxx"
+#include "locate_pattern.hxx"
+#include "trace.hxx"
+#include "work_pool.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <string>
+#include <unordered_set>
+
+#include <unicode/uiter.h>
+
+/* home */
+
+void setup_home_paths(char const *home, home_paths_t *result)
+{
+	result->home = home;
+	if(result->home.empty() || result->home.back() != '/'){
+		result->home.push_back('/');
+	}
+	result->trash = result->home + ".local/share/Trash/";
+	result->recent_documents = result->home + ".local/share/RecentDocuments/";
+}
+
+bool excluded(std::string_view path, home_paths_t const *home)
+{
+	return path.starts_with(home->trash) || path.starts_with(home->recent_documents);
+}
+
+bool hidden(std::string_view path)
+{
+	return path.find("/.") != std::string_view::npos;
+}
+
+void init_core_cache(core_cache_t *cache)
+{
+	if(locate_mtime(&cache->database_mtime) != 0){
+		cache->database_mtime = -1;
+	}
+}
+
+/* locate cache */
+
+/* a result of the query matching a superset of locate_query,
+   the shortest complete one, or else the longest prefix of the output */
+static std::shared_ptr<located_t const> find_wider(
+	core_cache_t *cache, locate_query_t const *locate_query, bool complete
+)
+{
+	std::shared_ptr<located_t const> result;
+	std::size_t result_length = 0;
+	cache->locate_cache.for_each(
+		[locate_query, complete, &result, &result_length](
+			locate_query_t const &key, std::shared_ptr<located_t const> const &value
+		){
+			if(
+				(complete ? value->complete : (value->stopped || value->partial))
+				&& key.base_name == locate_query->base_name
+				&& key.ignore_case == locate_query->ignore_case
+				&& narrower_locate_pattern(locate_query->pattern, key.pattern)
+			){
+				std::size_t length = value->list.size();
+				if(
+					result == nullptr
+					|| (complete ? length < result_length : length > result_length)
+				){
+					/* an empty one means that any extension is also empty */
+					result = value;
+					result_length = length;
+				}
+			}
+		}
+	);
+	return result;
+}
+
+/* filtering the result of the wider query in memory, keeping the order,
+   returns the number of the ones ranked first for query (in home and
+   not hidden), 0 if query is nullptr */
+static std::size_t filter_wider(
+	core_cache_t *cache, home_paths_t const *home, located_t const *wider,
+	locate_query_t const *locate_query, query_t const *query, located_t *result
+)
+{
+	locate_pattern_t pattern;
+	compile_locate_pattern(
+		locate_query->pattern, locate_query->base_name, locate_query->ignore_case,
+		&pattern
+	);
+	std::size_t first_ones = 0;
+	for(std::size_t i = 0; i < wider->list.size(); ++ i){
+		std::string_view item = cache->paths.get(wider->list[i]);
+		if(match_locate_pattern(item, &pattern)){
+			result->list.push_back(wider->list[i]);
+			result->types.push_back(wider->types[i]);
+			if(
+				query != nullptr && item.starts_with(home->home) && ! hidden(item)
+				&& match_query(item, query)
+			){
+				++ first_ones;
+			}
+		}
+	}
+	result->list.shrink_to_fit();
+	result->types.shrink_to_fit();
+	return first_ones;
+}
+
+/* the result saved by the last session */
+static bool find_stored(
+	core_cache_t *cache, core_context_t const *context,
+	locate_query_t const *locate_query, located_t *result
+)
+{
+	locate_store_t const *store = context->store.get();
+	if(
+		store == nullptr || store->mtime != cache->database_mtime
+		|| store->limit != context->locate_limit
+	){
+		return false;
+	}
+	bool complete;
+	bool dropped = false;
+	auto f = [cache, result, &dropped](std::string_view item, locate_type_t type){
+		path_id_t path;
+		if(cache->paths.intern(item, &path) != 0){
+			dropped = true;
+		}else{
+			result->list.push_back(path);
+			result->types.push_back(type);
+		}
+		return 0;
+	};
+	if(find_locate_store(store, locate_query, &complete, make_locate_callback(f)) != 0){
+		result->list.clear();
+		result->types.clear();
+		return false;
+	}
+	result->complete = complete && ! dropped;
+	result->list.shrink_to_fit();
+	result->types.shrink_to_fit();
+	return true;
+}
+
+/* stopping when the matches ranked first are enough for query,
+   if it is not nullptr,
+   Note: those are the first ones in the order of the database, so a later
+   match ranked higher by the names may be missed, it is intended, since
+   the rank of the rest is not bounded without reading all of it */
+static std::shared_ptr<located_t const> run_locate(
+	core_cache_t *cache, core_context_t const *context,
+	locate_query_t const *locate_query, query_t const *query,
+	locate_cancelled_t cancelled
+)
+{
+	std::shared_ptr<located_t> result = std::make_shared<located_t>();
+	result->stopped = false;
+	result->partial = false;
+	std::shared_ptr<located_t const> wider = find_wider(cache, locate_query, true);
+	bool enough = false; /* in the prefix of the output of a wider query */
+	if(wider == nullptr && query != nullptr){
+		std::shared_ptr<located_t const> prefix = find_wider(cache, locate_query, false);
+		if(prefix != nullptr){
+			enough = filter_wider(
+				cache, context->home, prefix.get(), locate_query, query, result.get()
+			) >= context->match_limit;
+			if(! enough){
+				result->list.clear();
+				result->types.clear();
+			}
+		}
+	}
+	if(wider != nullptr){
+		filter_wider(cache, context->home, wider.get(), locate_query, nullptr, result.get());
+		result->complete = true;
+		trace_count(tc_locate_wider);
+	}else if(enough){
+		/* as if locate is stopped for query */
+		result->complete = false;
+		result->stopped = true;
+		result->query = *query;
+		trace_count(tc_locate_wider);
+	}else if(find_stored(cache, context, locate_query, result.get())){
+		/* read from the file */
+		trace_count(tc_locate_stored);
+	}else{
+		std::uint64_t start = trace_begin();
+		home_paths_t const *home = context->home;
+		std::size_t limit = context->locate_limit;
+		std::size_t enough = context->match_limit;
+		std::size_t n = 0;
+		std::size_t first_ones = 0; /* in home and not hidden */
+		bool dropped = false;
+		auto f = [cache, home, query, enough, start, &result, &n, &first_ones, &dropped](
+			std::string_view item, locate_type_t type
+		){
+			if(++ n == 1){
+				trace_end(ts_first_byte, start);
+			}
+			if(! excluded(item, home)){
+				path_id_t path;
+				if(cache->paths.intern(item, &path) != 0){
+					dropped = true;
+				}else{
+					result->list.push_back(path);
+					result->types.push_back(type);
+					if(
+						query != nullptr && item.starts_with(home->home)
+						&& ! hidden(item) && match_query(item, query)
+						&& ++ first_ones >= enough
+					){
+						return ELOCATE_STOPPED;
+					}
+				}
+			}
+			return 0;
+		};
+		path_index_t const *index = context->index.get();
+		locate_helper_t *helper = context->helper.get();
+		int error = EPIPE;
+		if(index != nullptr && index->mtime == cache->database_mtime){
+			trace_count(tc_locate_index);
+			locate_pattern_t pattern;
+			compile_locate_pattern(
+				locate_query->pattern, locate_query->base_name, locate_query->ignore_case,
+				&pattern
+			);
+			error = path_index_locate(
+				index, &pattern, limit, make_locate_callback(f), cancelled
+			);
+			if(error == EUNSUPPORTED_DATABASE){ /* broken */
+				result->list.clear();
+				result->types.clear();
+				n = 0;
+				first_ones = 0;
+				dropped = false;
+				error = EPIPE;
+			}
+		}
+		if(error == EPIPE && helper != nullptr){
+			trace_count(tc_locate_helper);
+			error = locate_by_helper(
+				helper,
+				locate_query->pattern,
+				locate_query->base_name,
+				locate_query->ignore_case,
+				limit,
+				make_locate_callback(f),
+				cancelled
+			);
+		}
+		if(error == EPIPE){ /* without the helper, or it is lost */
+			trace_count(tc_locate_run);
+			result->list.clear();
+			result->types.clear();
+			n = 0;
+			first_ones = 0;
+			dropped = false;
+			int status;
+			error = locate(
+				locate_query->pattern,
+				locate_query->base_name,
+				locate_query->ignore_case,
+				limit,
+				f,
+				cancelled,
+				&status
+			);
+		}
+		if(error == ECANCELED){
+			if(result->list.empty() || dropped) return nullptr;
+			/* the next same query runs locate again, and the narrower ones may
+			   be answered from this */
+			result->complete = false;
+			result->partial = true;
+		}else if(error == ELOCATE_STOPPED){
+			result->complete = false;
+			result->stopped = true;
+			result->query = *query;
+		}else if(error != 0){
+			result->list.clear();
+			result->types.clear();
+			result->complete = false;
+		}else{
+			result->complete = n < limit && ! dropped;
+		}
+		result->list.shrink_to_fit();
+		result->types.shrink_to_fit();
+		trace_end(ts_locate, start, n);
+	}
+	
+	result->memory_size = sizeof(located_t) + locate_query->pattern.size()
+		+ result->list.capacity() * sizeof(path_id_t)
+		+ result->types.capacity() * sizeof(locate_type_t);
+	return result;
+}
+
+/* returns nullptr if cancelled */
+static std::shared_ptr<located_t const> locate_with_cache(
+	core_cache_t *cache, core_context_t const *context, query_t const *query,
+	locate_cancelled_t cancelled
+)
+{
+	locate_query_t const *locate_query = &query->locate_query;
+	bool missed = false;
+	std::shared_ptr<located_t const> result = cache->locate_cache.get(
+		*locate_query,
+		[cache, context, locate_query, query, cancelled, &missed](){
+			missed = true;
+			return run_locate(cache, context, locate_query, query, cancelled);
+		},
+		cancelled
+	);
+	trace_count(missed ? tc_locate_miss : tc_locate_hit);
+	/* cancelled last time,
+	   or the results enough for the other query may be not for this,
+	   then run again by one thread for all queries */
+	while(
+		result != nullptr
+		&& (result->partial || (result->stopped && ! (result->query == *query)))
+	){
+		if(cancelled()) return nullptr; /* the partial one is kept for the next */
+		result = cache->locate_cache.get_again(
+			*locate_query, result,
+			[cache, context, locate_query, cancelled](){
+				return run_locate(cache, context, locate_query, nullptr, cancelled);
+			},
+			cancelled
+		);
+	}
+	return result;
+}
+
+/* query cache */
+
+/* the number of UTF-16 units, same as the length of QString */
+static std::size_t count_units(std::string_view x)
+{
+	std::size_t result = 0;
+	UCharIterator iter;
+	uiter_setUTF8(&iter, x.data(), static_cast<std::int32_t>(x.size()));
+	while(iter.hasNext(&iter) != 0){
+		iter.next(&iter);
+		++ result;
+	}
+	return result;
+}
+
+ranked_t make_ranked(
+	path_pool_t const *paths, home_paths_t const *home, path_id_t path_id,
+	bool directory, std::size_t index
+)
+{
+	std::string_view path = paths->get(path_id);
+	ranked_t result;
+	result.path = path_id;
+	std::size_t sep = path.rfind('/');
+	result.base_name_position = (sep == std::string_view::npos) ? 0 : sep + 1;
+	result.not_in_home = ! path.starts_with(home->home);
+	result.hidden = hidden(path);
+	result.directory = directory;
+	if(sep == std::string_view::npos){
+		result.base_name_count = 0; /* something wrong */
+		result.dir_name_count = 0;
+	}else{
+		result.base_name_count = count_units(path.substr(sep + 1));
+		result.dir_name_count = count_units(path.substr(0, sep));
+	}
+	result.index = index;
+	return result;
+}
+
+static bool lt(ranked_t const &left, ranked_t const &right)
+{
+	if(left.not_in_home != right.not_in_home){
+		return left.not_in_home < right.not_in_home;
+	}
+	if(left.hidden != right.hidden){
+		return left.hidden < right.hidden;
+	}
+	if(left.base_name_count != right.base_name_count){
+		return left.base_name_count < right.base_name_count;
+	}
+	if(left.dir_name_count != right.dir_name_count){
+		return left.dir_name_count < right.dir_name_count;
+	}
+	return left.index < right.index;
+}
+
+static std::size_t queried_memory_size(query_t const *query, queried_t const *queried)
+{
+	return sizeof(queried_t) + query->locate_query.pattern.size()
+		+ query->matcher.tokens.capacity() * sizeof(pattern_token_t)
+		+ queried->list.capacity() * sizeof(ranked_t);
+}
+
+/* parallel, a list up to a chunk is done by the calling thread only */
+
+static std::size_t const match_chunk = 4096; /* the paths matched at once */
+static std::size_t const rank_chunk = 1024; /* the sort keys made at once */
+static std::size_t const sort_chunk = 8192; /* the least size sorted by a thread */
+
+/* calling body(first, last) for the chunks of [0, n) in the pool */
+template<class F>
+static void for_chunks(std::size_t n, std::size_t chunk, F const &body)
+{
+	get_work_pool()->run(
+		(n + chunk - 1) / chunk,
+		[n, chunk, &body](std::size_t i){
+			body(i * chunk, std::min(n, (i + 1) * chunk));
+		}
+	);
+}
+
+/* the first k ones of left and right merged,
+   the left one first if equal as std::merge */
+static void merge_least(
+	std::vector<ranked_t> const &left, std::vector<ranked_t> const &right,
+	std::size_t k, std::vector<ranked_t> *result
+)
+{
+	std::size_t n = std::min(k, left.size() + right.size());
+	result->reserve(n);
+	std::vector<ranked_t>::const_iterator l = left.cbegin();
+	std::vector<ranked_t>::const_iterator r = right.cbegin();
+	for(std::size_t i = 0; i < n; ++ i){
+		if(r == right.cend() || (l != left.cend() && ! lt(*r, *l))){
+			result->push_back(*l);
+			++ l;
+		}else{
+			result->push_back(*r);
+			++ r;
+		}
+	}
+}
+
+/* as std::partial_sort, sorting the chunks in the pool and merging the least
+   ones of them by pairs, the result is the same since lt is a total order */
+static void partial_sort_ranked(
+	std::vector<ranked_t>::iterator first, std::vector<ranked_t>::iterator middle,
+	std::vector<ranked_t>::iterator last
+)
+{
+	work_pool_t *pool = get_work_pool();
+	std::size_t size = last - first;
+	std::size_t k = middle - first;
+	std::size_t parts = std::min(pool->thread_count(), size / sort_chunk);
+	if(parts <= 1 || k == 0){
+		std::partial_sort(first, middle, last, lt);
+		return;
+	}
+	
+	std::vector<std::vector<ranked_t>> runs(parts);
+	pool->run(
+		parts,
+		[first, size, k, parts, &runs](std::size_t i){
+			std::vector<ranked_t>::iterator begin = first + size * i / parts;
+			std::vector<ranked_t>::iterator end = first + size * (i + 1) / parts;
+			std::vector<ranked_t>::iterator least =
+				begin + std::min<std::size_t>(k, end - begin);
+			std::partial_sort(begin, least, end, lt);
+			runs[i].assign(begin, least);
+		}
+	);
+	while(runs.size() > 1){
+		std::vector<std::vector<ranked_t>> merged((runs.size() + 1) / 2);
+		pool->run(
+			merged.size(),
+			[k, &runs, &merged](std::size_t i){
+				if(i * 2 + 1 < runs.size()){
+					merge_least(runs[i * 2], runs[i * 2 + 1], k, &merged[i]);
+				}else{
+					merged[i] = std::move(runs[i * 2]);
+				}
+			}
+		);
+		runs = std::move(merged);
+	}
+	
+	/* the rest are the greater ones than the last of the least */
+	std::vector<ranked_t> const &least = runs.front();
+	std::vector<ranked_t> rest;
+	rest.reserve(size - k);
+	for(std::vector<ranked_t>::const_iterator i = first; i != last; ++ i){
+		if(lt(least.back(), *i)) rest.push_back(*i);
+	}
+	std::copy(rest.cbegin(), rest.cend(), std::copy(least.cbegin(), least.cend(), first));
+}
+
+void rank(queried_t *queried, std::size_t limit)
+{
+	std::size_t n = std::min(limit, queried->list.size());
+	if(queried->sorted_length < n){
+		std::uint64_t start = trace_begin();
+		partial_sort_ranked(
+			queried->list.begin() + queried->sorted_length,
+			queried->list.begin() + n,
+			queried->list.end()
+		);
+		queried->sorted_length = n;
+		trace_end(ts_sort, start, queried->list.size());
+	}
+}
+
+/* the paths matched in a chunk of the result of locate */
+struct matched_chunk_t {
+	std::vector<path_id_t> paths;
+	std::vector<file_kind_t> kinds;
+	std::vector<std::size_t> unknown; /* in paths, to stat */
+};
+
+static std::shared_ptr<queried_t const> run_query(
+	core_cache_t *cache, core_context_t const *context, query_t const *query,
+	std::time_t now, locate_cancelled_t cancelled
+)
+{
+	std::shared_ptr<located_t const> located =
+		locate_with_cache(cache, context, query, cancelled);
+	if(located == nullptr) return nullptr;
+	
+	/* matching in memory first by chunks, then stat only the matched ones
+	   whose types are not known from the database, at once */
+	std::uint64_t start = trace_begin();
+	std::vector<matched_chunk_t> chunks((located->list.size() + match_chunk - 1) / match_chunk);
+	for_chunks(
+		located->list.size(), match_chunk,
+		[cache, query, &located, &chunks](std::size_t first, std::size_t last){
+			matched_chunk_t *chunk = &chunks[first / match_chunk];
+			for(std::size_t i = first; i < last; ++ i){
+				std::string_view item = cache->paths.get(located->list[i]);
+				if(match_query(item, query)){
+					file_kind_t kind;
+					if(! kind_by_locate_type(located->types[i], query, &kind)){
+						kind = fk_none; /* by stat_items */
+						chunk->unknown.push_back(chunk->paths.size());
+					}
+					chunk->paths.push_back(located->list[i]);
+					chunk->kinds.push_back(kind);
+				}
+			}
+		}
+	);
+	std::vector<path_id_t> matched;
+	std::vector<file_kind_t> kinds;
+	std::vector<std::string_view> items; /* to stat */
+	std::vector<std::size_t> item_indexes; /* in matched */
+	for(
+		std::vector<matched_chunk_t>::const_iterator i = chunks.cbegin();
+		i != chunks.cend();
+		++ i
+	){
+		for(
+			std::vector<std::size_t>::const_iterator j = i->unknown.cbegin();
+			j != i->unknown.cend();
+			++ j
+		){
+			items.push_back(cache->paths.get(i->paths[*j]));
+			item_indexes.push_back(matched.size() + *j);
+		}
+		matched.insert(matched.end(), i->paths.cbegin(), i->paths.cend());
+		kinds.insert(kinds.end(), i->kinds.cbegin(), i->kinds.cend());
+	}
+	chunks.clear();
+	/* this stays in match(), the types decide the filter and the icons,
+	   only the first query of a pattern does it for the paths without the
+	   types in the database, the later ones are refiltered in background */
+	std::vector<file_kind_t> stat_kinds(items.size());
+	stat_items(items.data(), items.size(), stat_kinds.data());
+	for(std::size_t i = 0; i < items.size(); ++ i){
+		kinds[item_indexes[i]] = stat_kinds[i];
+	}
+	trace_end(ts_filter, start, located->list.size());
+	
+	/* the sort keys are made by chunks, counting the characters */
+	std::size_t n = 0;
+	for(std::size_t i = 0; i < matched.size(); ++ i){
+		if(filter_file_kind(kinds[i], query)){
+			matched[n] = matched[i];
+			kinds[n] = kinds[i];
+			++ n;
+		}
+	}
+	std::shared_ptr<queried_t> result = std::make_shared<queried_t>();
+	result->list.resize(n);
+	for_chunks(
+		n, rank_chunk,
+		[cache, context, &matched, &kinds, &result](std::size_t first, std::size_t last){
+			for(std::size_t i = first; i < last; ++ i){
+				result->list[i] = make_ranked(
+					&cache->paths, context->home, matched[i], kinds[i] == fk_directory, i
+				);
+			}
+		}
+	);
+	result->sorted_length = 0;
+	rank(result.get(), context->match_limit);
+	result->max_length = n;
+	/* the types in the database are trusted as the paths checked by stat
+	   until refilter_interval, the deletions in home are merged from the
+	   overlay, and the cache is replaced after updatedb */
+	result->last_checked_time = now;
+	result->overlay_sequence = 0; /* merged by query_with_cache */
+	result->refiltering = false;
+	result->memory_size = queried_memory_size(query, result.get());
+	return result;
+}
+
+/* the deletions are recorded in the overlay, if the directory is watched
+   (not hidden, not excluded, under the limit of watches) and no event was lost */
+static bool watched_in_home(std::string_view path, core_context_t const *context)
+{
+	return context->overlay != nullptr && context->overlay->covers(path);
+}
+
+/* removing the paths for which remove(item) is true,
+   the rest of the sorted ones are still the least */
+template<class R>
+static void remove_ranked(queried_t *queried, R remove)
+{
+	std::size_t n = 0;
+	std::size_t sorted_length = queried->sorted_length;
+	for(std::size_t i = 0; i < queried->list.size(); ++ i){
+		ranked_t const &item = queried->list[i];
+		if(! remove(item)){
+			queried->list[n] = item;
+			++ n;
+		}else if(i < queried->sorted_length){
+			-- sorted_length;
+		}
+	}
+	queried->list.erase(queried->list.begin() + n, queried->list.end());
+	queried->sorted_length = sorted_length;
+}
+
+/* merging the changes in home after the database was made */
+static void merge_overlay(
+	core_cache_t *cache, core_context_t const *context, query_t const *query,
+	queried_t *queried
+)
+{
+	home_overlay_t const *overlay = context->overlay;
+	std::uint64_t sequence = overlay->sequence();
+	std::vector<std::pair<std::string, bool>> created; /* with directory */
+	std::vector<std::string> deleted; /* directories end with "/" */
+	overlay->for_each_since(
+		queried->overlay_sequence,
+		[&created, &deleted](std::string_view path, home_change_t const &change){
+			if(change.created){
+				created.emplace_back(path, change.directory);
+			}else{
+				deleted.emplace_back(path);
+				if(change.directory) deleted.back().push_back('/');
+			}
+		}
+	);
+	queried->overlay_sequence = sequence;
+	
+	if(! deleted.empty()){
+		remove_ranked(
+			queried,
+			[cache, &deleted](ranked_t const &ranked){
+				std::string_view item = cache->paths.get(ranked.path);
+				for(
+					std::vector<std::string>::const_iterator i = deleted.cbegin();
+					i != deleted.cend();
+					++ i
+				){
+					std::string_view deleted_path = *i;
+					if(deleted_path.ends_with('/')){
+						if(
+							item.starts_with(deleted_path)
+							|| item == deleted_path.substr(0, deleted_path.size() - 1)
+						){
+							return true;
+						}
+					}else if(item == deleted_path){
+						return true;
+					}
+				}
+				return false;
+			}
+		);
+	}
+	
+	if(! created.empty()){
+		locate_pattern_t pattern;
+		compile_locate_pattern(
+			query->locate_query.pattern, query->locate_query.base_name,
+			query->locate_query.ignore_case, &pattern
+		);
+		std::unordered_set<path_id_t> existing;
+		for(
+			std::vector<ranked_t>::const_iterator i = queried->list.cbegin();
+			i != queried->list.cend();
+			++ i
+		){
+			existing.insert(i->path);
+		}
+		/* the type is recorded by the watch, so match() does not stat */
+		std::size_t added = 0;
+		for(
+			std::vector<std::pair<std::string, bool>>::const_iterator i = created.cbegin();
+			i != created.cend();
+			++ i
+		){
+			file_kind_t kind = i->second ? fk_directory : fk_file;
+			path_id_t path;
+			if(
+				match_locate_pattern(i->first, &pattern) && match_query(i->first, query)
+				&& filter_file_kind(kind, query)
+				&& cache->paths.intern(i->first, &path) == 0 && existing.insert(path).second
+			){
+				queried->list.push_back(
+					make_ranked(
+						&cache->paths, context->home, path, i->second,
+						queried->max_length + added
+					)
+				);
+				++ added;
+			}
+		}
+		if(added > 0){
+			queried->max_length += added;
+			queried->sorted_length = 0; /* the new ones may be ranked first */
+		}
+	}
+}
+
+/* removing the paths removed after those were cached */
+static void refilter(
+	core_cache_t const *cache, core_context_t const *context, query_t const *query,
+	queried_t *queried
+)
+{
+	/* the deletions of the watched ones are merged from the overlay */
+	std::vector<std::string_view> items;
+	std::vector<path_id_t> paths;
+	for(
+		std::vector<ranked_t>::const_iterator i = queried->list.cbegin();
+		i != queried->list.cend();
+		++ i
+	){
+		std::string_view item = cache->paths.get(i->path);
+		if(! watched_in_home(item, context)){
+			items.push_back(item);
+			paths.push_back(i->path);
+		}
+	}
+	std::vector<file_kind_t> kinds(items.size());
+	stat_items(items.data(), items.size(), kinds.data());
+	
+	std::unordered_set<path_id_t> removed;
+	for(std::size_t i = 0; i < items.size(); ++ i){
+		if(! filter_file_kind(kinds[i], query)){
+			removed.insert(paths[i]);
+		}
+	}
+	if(! removed.empty()){
+		remove_ranked(
+			queried,
+			[&removed](ranked_t const &ranked){
+				return removed.count(ranked.path) > 0;
+			}
+		);
+	}
+}
+
+static std::shared_ptr<queried_t> update_queried(
+	core_cache_t *cache, core_context_t const *context, query_t const *query,
+	queried_t const *result, std::time_t now, bool stale, bool unmerged
+)
+{
+	std::shared_ptr<queried_t> updated = std::make_shared<queried_t>();
+	updated->list = result->list;
+	updated->sorted_length = result->sorted_length;
+	updated->max_length = result->max_length;
+	updated->overlay_sequence = result->overlay_sequence;
+	if(stale){
+		refilter(cache, context, query, updated.get());
+		updated->last_checked_time = now;
+	}else{
+		updated->last_checked_time = result->last_checked_time;
+	}
+	if(unmerged){
+		merge_overlay(cache, context, query, updated.get());
+	}
+	rank(updated.get(), context->match_limit);
+	updated->refiltering = false;
+	updated->memory_size = queried_memory_size(query, updated.get());
+	return updated;
+}
+
+std::shared_ptr<queried_t const> query_with_cache(
+	std::shared_ptr<core_cache_t> const &cache, core_context_t const *context,
+	query_t const *query, std::time_t now, locate_cancelled_t cancelled
+)
+{
+	bool missed = false;
+	std::shared_ptr<queried_t const> result =
+		cache->query_cache.get(
+			*query,
+			[&cache, context, query, now, cancelled, &missed](){
+				missed = true;
+				return run_query(cache.get(), context, query, now, cancelled);
+			},
+			cancelled
+		);
+	trace_count(missed ? tc_query_miss : tc_query_hit);
+	if(result == nullptr){
+		return nullptr;
+	}
+	std::size_t limit = context->match_limit;
+	bool stale = now - result->last_checked_time > refilter_interval;
+	bool unsorted = result->sorted_length < std::min(limit, result->list.size());
+	bool unmerged = context->overlay != nullptr
+		&& result->overlay_sequence != context->overlay->sequence();
+	if(stale && context->post && ! result->refiltering.exchange(true)){
+		context->post(
+			[cache, context = *context, query = *query, result, now, unmerged](){
+				std::shared_ptr<queried_t> updated = update_queried(
+					cache.get(), &context, &query, result.get(), now, true, unmerged
+				);
+				cache->query_cache.replace(query, updated);
+			}
+		);
+	}else if((stale || unsorted || unmerged) && ! result->refiltering.exchange(true)){
+		std::shared_ptr<queried_t> updated = update_queried(
+			cache.get(), context, query, result.get(), now, stale, unmerged
+		);
+		cache->query_cache.replace(*query, updated);
+		result = updated;
+	}
+	return result;
+}
+
+std::size_t trim_core_cache(core_cache_t *cache, std::size_t budget)
+{
+	std::size_t paths = cache->paths.memory_size();
+	std::size_t rest = budget > paths ? budget - paths : 0;
+	return cache->locate_cache.evict(rest / 2) + cache->query_cache.evict(rest / 2);
+}
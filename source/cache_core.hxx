@@ -0,0 +1,133 @@
+#ifndef CACHE_CORE_HXX
+#define CACHE_CORE_HXX
+
+#include "home_watch.hxx"
+#include "locate_store.hxx"
+#include "path_index.hxx"
+#include "path_pool.hxx"
+#include "query.hxx"
+#include "sharded_map.hxx"
+#include "use_locate.hxx"
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+#include <functional>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* the caches of the results of locate and the ranked results of the queries,
+   without Qt, shared by the plugin and test_cli */
+
+/* the results are checked by stat again after this */
+inline constexpr std::time_t refilter_interval = 60;
+
+/* home */
+
+struct home_paths_t {
+	std::string home; /* with "/" at the end */
+	std::string trash;
+	std::string recent_documents;
+};
+
+/* the paths of the user from $HOME */
+void setup_home_paths(char const *home, home_paths_t *result);
+
+/* in the trash or the recent documents */
+bool excluded(std::string_view path, home_paths_t const *home);
+
+/* under a directory starting with "." */
+bool hidden(std::string_view path);
+
+/* caches */
+/* Note: the caches may be used from several threads. */
+
+struct located_t {
+	std::vector<path_id_t> list; /* in the order of locate */
+	std::vector<locate_type_t> types; /* of list */
+	bool complete; /* not truncated by locate_limit or stopped */
+	bool stopped; /* enough for query */
+	bool partial; /* cancelled, a prefix of the output */
+	query_t query;
+	std::size_t memory_size; /* the paths are counted in core_cache_t::paths */
+	
+	located_t() = default;
+	located_t(located_t &&) = default;
+};
+
+/* the sort key of a path, computed once */
+struct ranked_t {
+	path_id_t path;
+	int base_name_position; /* after the last "/" */
+	bool not_in_home;
+	bool hidden;
+	bool directory;
+	std::size_t base_name_count;
+	std::size_t dir_name_count;
+	std::size_t index; /* ascending order of the path, for a stable result */
+};
+
+struct queried_t {
+	std::vector<ranked_t> list; /* sorted partially */
+	std::size_t sorted_length; /* the first ones are sorted */
+	std::size_t max_length;
+	std::time_t last_checked_time;
+	std::uint64_t overlay_sequence; /* merged changes of home_overlay */
+	mutable std::atomic<bool> refiltering;
+	std::size_t memory_size; /* the paths are counted in core_cache_t::paths */
+	
+	queried_t() = default;
+};
+
+/* the sort key of path, index is its position in the output of locate */
+ranked_t make_ranked(
+	path_pool_t const *paths, home_paths_t const *home, path_id_t path,
+	bool directory, std::size_t index
+);
+
+/* sorting more for the first limit ones, by the work pool if long */
+void rank(queried_t *queried, std::size_t limit);
+
+struct core_cache_t {
+	std::time_t database_mtime; /* when the cache is made, -1 if unknown */
+	path_pool_t paths; /* referred by the others, so destroyed last */
+	flight_cache_t<locate_query_t, located_t, locate_query_hash_t> locate_cache;
+	flight_cache_t<query_t, queried_t, query_hash_t> query_cache;
+};
+
+/* setting database_mtime */
+void init_core_cache(core_cache_t *cache);
+
+/* the settings and the sources of the results for a query,
+   copied into the work in background */
+struct core_context_t {
+	home_paths_t const *home;
+	std::size_t match_limit; /* the sorted ones */
+	std::size_t locate_limit;
+	std::shared_ptr<locate_store_t const> store; /* nullable */
+	std::shared_ptr<path_index_t const> index; /* nullable */
+	std::shared_ptr<locate_helper_t> helper; /* nullable */
+	home_overlay_t *overlay; /* nullptr if home is not watched */
+	/* running the refiltering in background,
+	   it is run in the calling thread if empty */
+	std::function<void (std::function<void ()>)> post;
+};
+
+/* returns nullptr if cancelled,
+   the first min(match_limit, list.size()) ones of the result are sorted usually,
+   the stale result is used until it is checked by stat in background */
+std::shared_ptr<queried_t const> query_with_cache(
+	std::shared_ptr<core_cache_t> const &cache, core_context_t const *context,
+	query_t const *query, std::time_t now, locate_cancelled_t cancelled
+);
+
+/* the paths are counted once against the budget, and can be freed only with
+   the whole cache (the caller clears it if those exceed the budget),
+   each of locate_cache and query_cache has the half of the rest,
+   returns the number of the evicted entries */
+std::size_t trim_core_cache(core_cache_t *cache, std::size_t budget);
+
+#endif
@@ -0,0 +1,473 @@
+#include "compiled_pattern.hxx"
+
+#include <cassert>
+#include <algorithm>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+
+/* ICU */
+#include <unicode/uchar.h>
+#include <unicode/utf8.h>
+
+std::string_view image(pattern_kind_t x)
+{
+	using namespace std::string_view_literals;
+	
+	switch(x){
+	case pk_empty:
+		return "empty"sv;
+	case pk_literal:
+		return "literal"sv;
+	case pk_stars:
+		return "stars"sv;
+	case pk_general:
+		return "general"sv;
+	default:
+		assert(false);
+		return std::string_view();
+	}
+}
+
+/* code points */
+
+static std::size_t decode(std::string_view s, std::size_t i, char32_t *c)
+{
+	std::int32_t index = static_cast<std::int32_t>(i);
+	UChar32 codepoint;
+	U8_NEXT(s.data(), index, static_cast<std::int32_t>(s.size()), codepoint);
+	if(codepoint < 0){
+		*c = static_cast<unsigned char>(s[i]); /* invalid sequence */
+		return 1;
+	}
+	*c = codepoint;
+	return index - i;
+}
+
+static char32_t fold(char32_t c)
+{
+	return u_tolower(c);
+}
+
+static bool is_continuation(char c)
+{
+	return (static_cast<unsigned char>(c) & 0xc0) == 0x80;
+}
+
+static char ascii_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+/* brackets */
+
+enum pattern_class_t {
+	pc_alnum, pc_alpha, pc_blank, pc_cntrl, pc_digit, pc_graph, pc_lower, pc_print,
+	pc_punct, pc_space, pc_upper, pc_xdigit
+};
+
+static char const * const class_names[] = {
+	"alnum", "alpha", "blank", "cntrl", "digit", "graph", "lower", "print",
+	"punct", "space", "upper", "xdigit"
+};
+
+static bool in_class(int cls, char32_t c)
+{
+	switch(cls){
+	case pc_alnum:
+		return u_isalnum(c);
+	case pc_alpha:
+		return u_isalpha(c);
+	case pc_blank:
+		return u_isblank(c);
+	case pc_cntrl:
+		return u_iscntrl(c);
+	case pc_digit:
+		return u_isdigit(c);
+	case pc_graph:
+		return u_isgraph(c);
+	case pc_lower:
+		return u_islower(c);
+	case pc_print:
+		return u_isprint(c);
+	case pc_punct:
+		return u_ispunct(c);
+	case pc_space:
+		return u_isspace(c);
+	case pc_upper:
+		return u_isupper(c);
+	case pc_xdigit:
+		return u_isxdigit(c);
+	default:
+		return false;
+	}
+}
+
+/* returns the position after "]", or npos if it is not a bracket */
+static std::size_t parse_bracket(
+	std::string_view pattern, std::size_t position, bool ignore_case,
+	pattern_bracket_t *result
+)
+{
+	std::size_t i = position + 1;
+	result->negated = false;
+	if(i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')){
+		result->negated = true;
+		++ i;
+	}
+	bool first = true;
+	while(i < pattern.size()){
+		if(pattern[i] == ']' && ! first) return i + 1;
+		first = false;
+		char32_t low;
+		if(pattern[i] == '[' && i + 1 < pattern.size() && pattern[i + 1] == ':'){
+			std::size_t close = pattern.find(":]", i + 2);
+			if(close == std::string_view::npos) return std::string_view::npos;
+			std::string_view name = pattern.substr(i + 2, close - (i + 2));
+			int cls = -1;
+			for(std::size_t j = 0; j < std::size(class_names); ++ j){
+				if(name == class_names[j]) cls = j;
+			}
+			if(cls < 0) return std::string_view::npos;
+			result->classes.push_back(cls);
+			i = close + 2;
+			continue;
+		}else if(
+			pattern[i] == '[' && i + 1 < pattern.size()
+			&& (pattern[i + 1] == '.' || pattern[i + 1] == '=')
+		){
+			/* a collating symbol or an equivalence class of one character */
+			char terminator[3] = {pattern[i + 1], ']', '\0'};
+			std::size_t close = pattern.find(terminator, i + 2);
+			if(close == std::string_view::npos) return std::string_view::npos;
+			std::size_t length = decode(pattern, i + 2, &low);
+			if(i + 2 + length != close) return std::string_view::npos;
+			i = close + 2;
+		}else{
+			if(pattern[i] == '\\' && i + 1 < pattern.size()) ++ i;
+			i += decode(pattern, i, &low);
+		}
+		char32_t high = low;
+		if(
+			i + 1 < pattern.size() && pattern[i] == '-' && pattern[i + 1] != ']'
+		){
+			++ i;
+			if(pattern[i] == '\\' && i + 1 < pattern.size()) ++ i;
+			i += decode(pattern, i, &high);
+		}
+		result->ranges.emplace_back(low, high);
+		if(ignore_case){
+			result->ranges.emplace_back(fold(low), fold(high));
+		}
+	}
+	return std::string_view::npos;
+}
+
+static bool in_bracket(
+	pattern_bracket_t const *bracket, char32_t c, bool ignore_case
+)
+{
+	bool matched = false;
+	char32_t folded = ignore_case ? fold(c) : c;
+	for(
+		std::vector<std::pair<char32_t, char32_t>>::const_iterator i =
+			bracket->ranges.cbegin();
+		i != bracket->ranges.cend() && ! matched;
+		++ i
+	){
+		matched = (c >= i->first && c <= i->second)
+			|| (folded >= i->first && folded <= i->second);
+	}
+	for(
+		std::vector<int>::const_iterator i = bracket->classes.cbegin();
+		i != bracket->classes.cend() && ! matched;
+		++ i
+	){
+		matched = in_class(*i, c);
+	}
+	return matched != bracket->negated;
+}
+
+/* compiling */
+
+void compile_pattern(
+	std::string_view pattern, bool ignore_case, compiled_pattern_t *result
+)
+{
+	result->ignore_case = ignore_case;
+	result->literal.clear();
+	result->segments.clear();
+	result->leading_star = false;
+	result->trailing_star = false;
+	result->tokens.clear();
+	result->brackets.clear();
+	if(pattern.empty()){
+		result->kind = pk_empty;
+		return;
+	}
+	
+	bool stars = false;
+	bool others = false;
+	bool ascii = true;
+	std::string segment;
+	std::size_t i = 0;
+	while(i < pattern.size()){
+		char c = pattern[i];
+		if(c == '*'){
+			stars = true;
+			if(i == 0) result->leading_star = true;
+			if(result->tokens.empty() || result->tokens.back().kind != tk_star){
+				result->tokens.push_back(pattern_token_t{tk_star, 0, 0});
+			}
+			result->segments.push_back(std::move(segment));
+			segment.clear();
+			++ i;
+			continue;
+		}else if(c == '?'){
+			others = true;
+			result->tokens.push_back(pattern_token_t{tk_any, 0, 0});
+			++ i;
+			continue;
+		}else if(c == '['){
+			pattern_bracket_t bracket;
+			std::size_t next = parse_bracket(pattern, i, ignore_case, &bracket);
+			if(next != std::string_view::npos){
+				others = true;
+				result->tokens.push_back(
+					pattern_token_t{tk_bracket, 0, result->brackets.size()}
+				);
+				result->brackets.push_back(std::move(bracket));
+				i = next;
+				continue;
+			}
+			/* a literal "[" */
+		}else if(c == '\\' && i + 1 < pattern.size()){
+			++ i;
+		}
+		char32_t codepoint;
+		std::size_t length = decode(pattern, i, &codepoint);
+		if(codepoint >= 0x80) ascii = false;
+		segment.append(pattern.substr(i, length));
+		result->tokens.push_back(
+			pattern_token_t{tk_char, ignore_case ? fold(codepoint) : codepoint, 0}
+		);
+		i += length;
+	}
+	result->trailing_star = ! result->tokens.empty() && result->tokens.back().kind == tk_star;
+	result->segments.push_back(std::move(segment));
+	
+	if(ignore_case && ! ascii){
+		result->kind = pk_general; /* folding is not by byte */
+	}else if(others){
+		result->kind = pk_general;
+	}else if(stars){
+		result->kind = pk_stars;
+	}else{
+		result->kind = pk_literal;
+		result->literal.swap(result->segments.front());
+		result->segments.clear();
+	}
+	if(result->kind == pk_general){
+		result->segments.clear();
+	}
+}
+
+/* the fast paths */
+
+static bool equal_at(
+	std::string_view item, std::size_t position, std::string_view s, bool ignore_case
+)
+{
+	if(item.size() - position < s.size()) return false;
+	if(! ignore_case) return item.compare(position, s.size(), s) == 0;
+	for(std::size_t i = 0; i < s.size(); ++ i){
+		if(ascii_lower(item[position + i]) != ascii_lower(s[i])) return false;
+	}
+	return true;
+}
+
+static std::size_t find(
+	std::string_view item, std::string_view s, std::size_t from, bool ignore_case
+)
+{
+	if(from > item.size()) return std::string_view::npos;
+	if(! ignore_case){
+		void const *p =
+			memmem(item.data() + from, item.size() - from, s.data(), s.size());
+		return (p == nullptr) ?
+			std::string_view::npos : static_cast<char const *>(p) - item.data();
+	}
+	if(s.empty()) return from;
+	for(std::size_t i = from; i + s.size() <= item.size(); ++ i){
+		if(equal_at(item, i, s, true)) return i;
+	}
+	return std::string_view::npos;
+}
+
+static bool has_slash(std::string_view item, std::size_t from)
+{
+	return item.find('/', from) != std::string_view::npos;
+}
+
+/* the segments of "*" in a base name, from start or anywhere after it */
+static bool match_stars(
+	compiled_pattern_t const *pattern, std::string_view item, std::size_t start,
+	bool anchored, bool at_end
+)
+{
+	std::vector<std::string>::const_iterator i = pattern->segments.cbegin();
+	std::vector<std::string>::const_iterator last = pattern->segments.cend() - 1;
+	std::size_t position = start;
+	if(anchored && ! pattern->leading_star){
+		if(! equal_at(item, position, *i, pattern->ignore_case)) return false;
+		position += i->size();
+		if(i == last) return ! at_end || position == item.size();
+		++ i;
+	}
+	for(; i != last; ++ i){
+		std::size_t found = find(item, *i, position, pattern->ignore_case);
+		if(found == std::string_view::npos) return false;
+		position = found + i->size();
+	}
+	if(at_end && ! pattern->trailing_star){
+		return item.size() - position >= last->size()
+			&& equal_at(item, item.size() - last->size(), *last, pattern->ignore_case);
+	}else{
+		return find(item, *last, position, pattern->ignore_case) != std::string_view::npos;
+	}
+}
+
+/* the general path */
+
+static bool match_token(
+	compiled_pattern_t const *pattern, pattern_token_t const *token, char32_t c
+)
+{
+	if(c == '/') return token->kind == tk_char && token->c == '/';
+	switch(token->kind){
+	case tk_char:
+		return (pattern->ignore_case ? fold(c) : c) == token->c;
+	case tk_any:
+		return true;
+	case tk_bracket:
+		return in_bracket(
+			&pattern->brackets[token->bracket], c, pattern->ignore_case
+		);
+	default:
+		return false;
+	}
+}
+
+/* backtracking only to the last "*", since "*" can not match "/",
+   the components of the pattern and the path are matched one by one */
+static bool match_tokens(
+	compiled_pattern_t const *pattern, std::string_view item, std::size_t start,
+	bool at_end
+)
+{
+	std::size_t const n = pattern->tokens.size();
+	std::size_t t = start;
+	std::size_t p = 0;
+	std::size_t star_p = n; /* none */
+	std::size_t star_t = 0;
+	for(;;){
+		if(p < n){
+			pattern_token_t const *token = &pattern->tokens[p];
+			if(token->kind == tk_star){
+				star_p = p;
+				star_t = t;
+				++ p;
+				continue;
+			}
+			if(t < item.size()){
+				char32_t c;
+				std::size_t length = decode(item, t, &c);
+				if(match_token(pattern, token, c)){
+					t += length;
+					++ p;
+					continue;
+				}
+			}
+		}else if(t == item.size() || (! at_end && ! has_slash(item, t))){
+			return true;
+		}
+		/* the last "*" takes one more character */
+		if(star_p == n || star_t >= item.size() || item[star_t] == '/') return false;
+		char32_t c;
+		star_t += decode(item, star_t, &c);
+		t = star_t;
+		p = star_p + 1;
+	}
+}
+
+bool match_pattern_at(
+	compiled_pattern_t const *pattern, std::string_view item, std::size_t start,
+	bool at_end
+)
+{
+	switch(pattern->kind){
+	case pk_empty:
+		return false;
+	case pk_literal:
+		if(! equal_at(item, start, pattern->literal, pattern->ignore_case)){
+			return false;
+		}
+		start += pattern->literal.size();
+		return at_end ? start == item.size() : ! has_slash(item, start);
+	case pk_stars:
+		if(! has_slash(item, start)){
+			return match_stars(pattern, item, start, true, at_end);
+		}
+		break;
+	default:
+		break;
+	}
+	return match_tokens(pattern, item, start, at_end);
+}
+
+bool search_pattern(
+	compiled_pattern_t const *pattern, std::string_view item, std::size_t first,
+	bool at_end
+)
+{
+	if(first >= item.size()) return false;
+	switch(pattern->kind){
+	case pk_empty:
+		return false;
+	case pk_literal:
+		{
+			std::size_t length = pattern->literal.size();
+			if(at_end){
+				return item.size() - first >= length
+					&& equal_at(item, item.size() - length, pattern->literal, pattern->ignore_case);
+			}
+			/* the rest after the found literal should not contain "/" */
+			std::size_t last_slash = item.rfind('/');
+			std::size_t from = first;
+			if(last_slash != std::string_view::npos && last_slash + 1 > length){
+				from = std::max(from, last_slash + 1 - length);
+			}
+			return find(item, pattern->literal, from, pattern->ignore_case)
+				!= std::string_view::npos;
+		}
+	case pk_stars:
+		if(! has_slash(item, first)){
+			return match_stars(pattern, item, first, false, at_end);
+		}
+		break;
+	default:
+		break;
+	}
+	
+	pattern_token_t const *head = &pattern->tokens.front();
+	bool ascii_head = head->kind == tk_char && head->c < 0x80 && head->c != '/';
+	for(std::size_t i = first; i < item.size(); ++ i){
+		if(is_continuation(item[i])) continue;
+		if(ascii_head){
+			char c = pattern->ignore_case ? ascii_lower(item[i]) : item[i];
+			if(static_cast<char32_t>(static_cast<unsigned char>(c)) != head->c) continue;
+		}
+		if(match_tokens(pattern, item, i, at_end)) return true;
+	}
+	return false;
+}
@@ -0,0 +1,79 @@
+#ifndef COMPILED_PATTERN_HXX
+#define COMPILED_PATTERN_HXX
+
+#include <compare>
+#include <cstddef>
+#include <string>
+#include <utility>
+#include <string_view>
+#include <vector>
+
+/* a pattern of fnmatch(3) with FNM_PATHNAME (and FNM_CASEFOLD),
+   compiled once for matching many paths */
+
+enum pattern_kind_t {
+	pk_empty, /* never matches */
+	pk_literal, /* no wildcards */
+	pk_stars, /* literals and "*" only */
+	pk_general
+};
+
+enum pattern_token_kind_t {tk_char, tk_any, tk_bracket, tk_star};
+
+struct pattern_token_t {
+	pattern_token_kind_t kind;
+	char32_t c; /* tk_char, folded if ignore_case */
+	std::size_t bracket; /* tk_bracket, index of brackets */
+};
+
+struct pattern_bracket_t {
+	bool negated;
+	std::vector<std::pair<char32_t, char32_t>> ranges;
+	std::vector<int> classes; /* pattern_class_t */
+};
+
+struct compiled_pattern_t {
+	pattern_kind_t kind;
+	bool ignore_case;
+	std::string literal; /* pk_literal */
+	std::vector<std::string> segments; /* pk_stars, split by "*" */
+	bool leading_star;
+	bool trailing_star;
+	std::vector<pattern_token_t> tokens;
+	std::vector<pattern_bracket_t> brackets;
+	
+	/* it is derived from the source pattern, so no need to compare */
+	friend std::strong_ordering operator <=> (
+		compiled_pattern_t const &, compiled_pattern_t const &
+	)
+	{
+		return std::strong_ordering::equal;
+	}
+	
+	friend bool operator == (compiled_pattern_t const &, compiled_pattern_t const &)
+	{
+		return true;
+	}
+};
+
+std::string_view image(pattern_kind_t x);
+
+void compile_pattern(
+	std::string_view pattern, bool ignore_case, compiled_pattern_t *result
+);
+
+/* whether the pattern matches item from start,
+   to the end if at_end, or else leaving only a base name
+   (same as appending "*") */
+bool match_pattern_at(
+	compiled_pattern_t const *pattern, std::string_view item, std::size_t start,
+	bool at_end
+);
+
+/* same as above, from any of the positions after first */
+bool search_pattern(
+	compiled_pattern_t const *pattern, std::string_view item, std::size_t first,
+	bool at_end
+);
+
+#endif
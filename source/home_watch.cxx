@@ -0,0 +1,298 @@
+#include "home_watch.hxx"
+#include "use_locate.hxx"
+
+#include <cerrno>
+#include <cstring>
+#include <system_error>
+#include <unordered_map>
+
+#include <dirent.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* overlay */
+
+void home_overlay_t::record(std::string_view path, bool created, bool directory)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	if(! created && directory){
+		/* the deletion covers the changes under it, the created ones would
+		   stay in the results otherwise */
+		std::string prefix(path);
+		prefix.push_back('/');
+		std::map<std::string, home_change_t, std::less<>>::iterator j =
+			this->changes.lower_bound(prefix);
+		while(j != this->changes.end() && j->first.starts_with(prefix)){
+			j = this->changes.erase(j);
+		}
+	}
+	std::map<std::string, home_change_t, std::less<>>::iterator i =
+		this->changes.find(path);
+	if(i == this->changes.end()){
+		if(this->changes.size() >= max_size) return;
+		i = this->changes.emplace(std::string(path), home_change_t{}).first;
+	}
+	i->second.created = created;
+	i->second.directory = directory;
+	i->second.sequence = ++ this->last_sequence;
+}
+
+void home_overlay_t::watch(std::string_view directory, bool watched)
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	if(watched){
+		this->directories.emplace(directory);
+	}else{
+		std::set<std::string, std::less<>>::iterator i = this->directories.find(directory);
+		if(i != this->directories.end()) this->directories.erase(i);
+	}
+}
+
+void home_overlay_t::lose_events()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->lost = true;
+}
+
+bool home_overlay_t::covers(std::string_view path) const
+{
+	std::size_t slash = path.rfind('/');
+	if(slash == std::string_view::npos) return false;
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return ! this->lost
+		&& this->directories.find(path.substr(0, slash + 1)) != this->directories.end();
+}
+
+void home_overlay_t::clear()
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	this->changes.clear();
+	this->lost = false;
+	++ this->last_sequence; /* the merged results are also invalid */
+}
+
+std::uint64_t home_overlay_t::sequence() const
+{
+	std::lock_guard<std::mutex> lock(this->mutex);
+	return this->last_sequence;
+}
+
+/* watch */
+
+static std::uint32_t const watch_mask =
+	IN_CREATE | IN_DELETE | IN_MOVED_FROM | IN_MOVED_TO | IN_ONLYDIR | IN_DONT_FOLLOW;
+
+struct home_watch_state_t {
+	int fd;
+	int stop_fd;
+	std::vector<std::string> const *excluded;
+	home_overlay_t *overlay;
+	std::unordered_map<int, std::string> directories; /* by watch descriptor */
+	bool full; /* the limit of watches */
+};
+
+static bool watched(home_watch_state_t const *state, std::string_view path)
+{
+	if(path.find("/.") != std::string_view::npos) return false; /* hidden */
+	for(
+		std::vector<std::string>::const_iterator i = state->excluded->cbegin();
+		i != state->excluded->cend();
+		++ i
+	){
+		if(path.starts_with(*i)) return false;
+	}
+	return true;
+}
+
+static bool stopped(home_watch_state_t const *state)
+{
+	struct pollfd fds[1] = {{state->stop_fd, POLLIN, 0}};
+	return poll(fds, 1, 0) > 0;
+}
+
+/* path ends with "/",
+   the entries existing at the time are recorded if created */
+static void add_directory(
+	home_watch_state_t *state, std::string const &path, bool created
+)
+{
+	if(state->full || ! watched(state, path) || stopped(state)) return;
+	int wd = inotify_add_watch(state->fd, path.c_str(), watch_mask);
+	if(wd < 0){
+		if(errno == ENOSPC) state->full = true;
+		return;
+	}
+	state->directories[wd] = path;
+	state->overlay->watch(path, true);
+	
+	DIR *dir = opendir(path.c_str());
+	if(dir == nullptr) return;
+	std::vector<std::string> subdirectories;
+	struct dirent *entry;
+	while((entry = readdir(dir)) != nullptr){
+		if(
+			std::strcmp(entry->d_name, ".") == 0 || std::strcmp(entry->d_name, "..") == 0
+		){
+			continue;
+		}
+		std::string entry_path = path + entry->d_name;
+		unsigned char type = entry->d_type;
+		if(type == DT_UNKNOWN){
+			struct stat statbuf;
+			if(fstatat(dirfd(dir), entry->d_name, &statbuf, AT_SYMLINK_NOFOLLOW) == 0){
+				if(S_ISDIR(statbuf.st_mode)){
+					type = DT_DIR;
+				}else if(S_ISREG(statbuf.st_mode)){
+					type = DT_REG;
+				}
+			}
+		}
+		bool directory = type == DT_DIR;
+		if(created && (type == DT_DIR || type == DT_REG)){
+			state->overlay->record(entry_path, true, directory);
+		}
+		if(directory){
+			entry_path.push_back('/');
+			subdirectories.push_back(std::move(entry_path));
+		}
+	}
+	closedir(dir);
+	for(
+		std::vector<std::string>::const_iterator i = subdirectories.cbegin();
+		i != subdirectories.cend();
+		++ i
+	){
+		add_directory(state, *i, created);
+	}
+}
+
+static void handle_event(home_watch_state_t *state, struct inotify_event const *event)
+{
+	if((event->mask & IN_Q_OVERFLOW) != 0){
+		state->overlay->lose_events();
+		return;
+	}
+	if((event->mask & IN_IGNORED) != 0){
+		std::unordered_map<int, std::string>::iterator dir =
+			state->directories.find(event->wd);
+		if(dir != state->directories.end()){
+			state->overlay->watch(dir->second, false);
+			state->directories.erase(dir);
+		}
+		return;
+	}
+	if(event->len == 0) return;
+	std::unordered_map<int, std::string>::const_iterator dir =
+		state->directories.find(event->wd);
+	if(dir == state->directories.cend()) return;
+	std::string path = dir->second + event->name;
+	if(! watched(state, path)) return;
+	bool directory = (event->mask & IN_ISDIR) != 0;
+	if((event->mask & (IN_CREATE | IN_MOVED_TO)) != 0){
+		/* only the directories and the regular files as add_directory,
+		   so the results do not need stat for the type */
+		struct stat statbuf;
+		if(! directory && (lstat(path.c_str(), &statbuf) < 0 || ! S_ISREG(statbuf.st_mode))){
+			return;
+		}
+		state->overlay->record(path, true, directory);
+		if(directory){
+			path.push_back('/');
+			add_directory(state, path, true);
+		}
+	}else if((event->mask & (IN_DELETE | IN_MOVED_FROM)) != 0){
+		state->overlay->record(path, false, directory);
+		if(directory){
+			/* the watches under it are replaced by IN_MOVED_TO */
+			path.push_back('/');
+			std::erase_if(
+				state->directories,
+				[state, &path](std::pair<int const, std::string> const &item){
+					if(! item.second.starts_with(path)) return false;
+					inotify_rm_watch(state->fd, item.first);
+					state->overlay->watch(item.second, false);
+					return true;
+				}
+			);
+		}
+	}
+}
+
+static void run_home_watch(
+	int fd, int stop_fd, std::string root, std::vector<std::string> excluded,
+	home_overlay_t *overlay
+)
+{
+	home_watch_state_t state{fd, stop_fd, &excluded, overlay, {}, false};
+	add_directory(&state, root, false);
+	
+	alignas(struct inotify_event) char buffer[0x10000];
+	for(;;){
+		struct pollfd fds[2] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(fds[1].revents != 0) break;
+		ssize_t r = read(fd, buffer, sizeof(buffer));
+		if(r < 0){
+			if(errno == EINTR || errno == EAGAIN) continue;
+			break;
+		}
+		for(char const *p = buffer; p < buffer + r; ){
+			struct inotify_event const *event =
+				reinterpret_cast<struct inotify_event const *>(p);
+			handle_event(&state, event);
+			p += sizeof(struct inotify_event) + event->len;
+		}
+	}
+	for(
+		std::unordered_map<int, std::string>::const_iterator i = state.directories.cbegin();
+		i != state.directories.cend();
+		++ i
+	){
+		overlay->watch(i->second, false);
+	}
+}
+
+int start_home_watch(
+	std::string root, std::vector<std::string> excluded, home_overlay_t *overlay,
+	home_watch_t *watch
+)
+{
+	int error;
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0) return nonzero_errno(errno);
+	int stop_fd = eventfd(0, EFD_CLOEXEC);
+	if(stop_fd < 0){
+		error = nonzero_errno(errno);
+		close(fd);
+		return error;
+	}
+	try{
+		/* adding the watches recursively takes time, so in the thread */
+		watch->thread = std::thread(
+			run_home_watch, fd, stop_fd, std::move(root), std::move(excluded), overlay
+		);
+	}catch(std::system_error const &e){
+		close(stop_fd);
+		close(fd);
+		return nonzero_errno(e.code().value());
+	}
+	watch->fd = fd;
+	watch->stop_fd = stop_fd;
+	return 0;
+}
+
+void stop_home_watch(home_watch_t *watch)
+{
+	std::uint64_t one = 1;
+	while(write(watch->stop_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+	watch->thread.join();
+	close(watch->stop_fd);
+	close(watch->fd);
+}
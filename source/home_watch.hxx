@@ -0,0 +1,82 @@
+#ifndef HOME_WATCH_HXX
+#define HOME_WATCH_HXX
+
+#include <cstddef>
+#include <cstdint>
+#include <map>
+#include <mutex>
+#include <set>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+/* the paths created or deleted after the database was made */
+
+struct home_change_t {
+	bool created; /* or deleted */
+	bool directory;
+	std::uint64_t sequence;
+};
+
+class home_overlay_t {
+	static constexpr std::size_t max_size = 0x10000;
+	
+	mutable std::mutex mutex;
+	std::map<std::string, home_change_t, std::less<>> changes;
+	std::uint64_t last_sequence = 0;
+	std::set<std::string, std::less<>> directories; /* watched, end with "/" */
+	bool lost = false; /* some events */
+	
+public:
+	/* ignored if too many */
+	void record(std::string_view path, bool created, bool directory);
+	
+	/* by the watch, directory ends with "/" */
+	void watch(std::string_view directory, bool watched);
+	
+	/* by the watch on IN_Q_OVERFLOW, nothing is covered until clear() */
+	void lose_events();
+	
+	/* true if the deletion of path is recorded, its directory is watched
+	   and no event was lost */
+	bool covers(std::string_view path) const;
+	
+	/* the database has the changes */
+	void clear();
+	
+	std::uint64_t sequence() const;
+	
+	/* calling f(path, change) for each change after sequence */
+	template<class F>
+	void for_each_since(std::uint64_t sequence, F f) const
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		for(
+			std::map<std::string, home_change_t, std::less<>>::const_iterator i =
+				this->changes.cbegin();
+			i != this->changes.cend();
+			++ i
+		){
+			if(i->second.sequence > sequence) f(std::string_view(i->first), i->second);
+		}
+	}
+};
+
+/* watching the directories under home with inotify,
+   except hidden ones and excluded ones */
+
+struct home_watch_t {
+	int fd; /* inotify */
+	int stop_fd; /* eventfd */
+	std::thread thread;
+};
+
+/* root and excluded end with "/" */
+int start_home_watch(
+	std::string root, std::vector<std::string> excluded, home_overlay_t *overlay,
+	home_watch_t *watch
+);
+void stop_home_watch(home_watch_t *watch);
+
+#endif
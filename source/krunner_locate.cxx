@@ -1,17 +1,36 @@
 #include "krunner_locate.hxx"
+#include "cache_core.hxx"
+#include "home_watch.hxx"
+#include "locate_store.hxx"
+#include "path_index.hxx"
+#include "path_pool.hxx"
 #include "query.hxx"
+#include "sharded_map.hxx"
+#include "trace.hxx"
 #include "use_locate.hxx"
 
 #include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cerrno>
 #include <cstdio>
-#include <forward_list>
-#include <map>
-#include <set>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <system_error>
+#include <thread>
+#include <vector>
 
 #include <sys/time.h>
 
 #include <QDir>
+#include <QIcon>
+#include <QMimeDatabase>
+#include <QMimeType>
+#include <QStandardPaths>
+#include <QThreadPool>
 
+#include <KConfigGroup>
 #include <KIO/JobUiDelegateFactory>
 #include <KIO/OpenFileManagerWindowJob>
 #include <KIO/OpenUrlJob>
@@ -23,16 +42,15 @@ static char const (log_name [[maybe_unused]])[] = "krunner_locate";
 #ifdef LOGGING
 static bool log_handler_installed = false;
 static QtMessageHandler original_log_handler = nullptr;
+static FILE *log_file = nullptr; /* kept open, written by a line */
 
 static void log_handler(
 	QtMsgType type, QMessageLogContext const &context, QString const &str
 )
 {
-	FILE *f = std::fopen("/tmp/krunner.log", "a");
-	if(f != nullptr){
+	if(log_file != nullptr){
 		QString const message = qFormatLogMessage(type, context, str);
-		std::fprintf(f, "%s\n", qPrintable(message));
-		std::fclose(f);
+		std::fprintf(log_file, "%s\n", qPrintable(message));
 	}
 	
 	if(original_log_handler){
@@ -44,6 +62,10 @@ static void install_log_handler()
 {
 	if(! log_handler_installed){
 		log_handler_installed = true;
+		log_file = std::fopen("/tmp/krunner.log", "ae");
+		if(log_file != nullptr){
+			std::setvbuf(log_file, nullptr, _IOLBF, 0);
+		}
 		original_log_handler = qInstallMessageHandler(log_handler);
 	}
 }
@@ -58,257 +80,626 @@ static std::string_view stringview_of_qbytearray(QByteArray const *x)
 
 /* home */
 
-static QByteArray home_path;
-static QByteArray trash_path;
-static QByteArray recent_documents_path;
+static home_paths_t home_paths;
 
 static void setup_home_path()
 {
-	if(home_path.isEmpty()){
-		home_path = QDir::homePath().toUtf8();
-		home_path.append(u'/');
-		trash_path = home_path;
-		trash_path.append(QByteArrayLiteral(".local/share/Trash/"));
-		recent_documents_path = home_path;
-		recent_documents_path.append(
-			QByteArrayLiteral(".local/share/RecentDocuments/")
-		);
+	if(home_paths.home.empty()){
+		setup_home_paths(QDir::homePath().toUtf8().constData(), &home_paths);
 	}
 }
 
-static bool excluded(QByteArray const &path)
+/* configuration */
+
+static std::size_t const default_cache_budget_mib = 64;
+static std::size_t const default_match_limit = 100;
+
+static std::atomic<std::size_t> cache_budget = default_cache_budget_mib << 20;
+static std::atomic<std::size_t> match_limit = default_match_limit;
+static std::atomic<std::size_t> locate_limit = default_locate_limit;
+
+/* the icons and the modification time of the database are checked again
+   after this */
+static std::time_t const interval = 60;
+
+/* the changes in home after the database was made, if watched */
+static home_overlay_t home_overlay;
+static std::atomic<bool> home_watched = false;
+
+/* background work */
+/* The lookups of the icons and the refiltering by lstat, not in the global
+   pool of the process, since the plugin may be unloaded while the work is
+   queued (and the work refers to the statics), ~LocateRunner waits for this
+   pool. The threads are mostly blocked in a slow file system like NFS, so
+   there are more of them than the cores, and the other runners are not
+   starved. */
+
+static int const background_threads = 16;
+static QThreadPool background_pool;
+
+/* caches */
+/* Note: match() may be called from several threads. */
+/* Note: QByteArray and QString are reference counted atomically. */
+
+struct qbytearray_hash_t {
+	std::size_t operator () (QByteArray const &x) const
+	{
+		return qHash(x);
+	}
+};
+
+struct qstring_hash_t {
+	std::size_t operator () (QString const &x) const
+	{
+		return qHash(x);
+	}
+};
+
+/* the parts of QueryMatch */
+struct display_t {
+	QUrl url;
+	QString id;
+	QString text; /* the base name */
+	QString subtext; /* the directory name, "~" for home */
+};
+
+struct icon_t {
+	QString icon_name;
+	std::time_t last_checked_time;
+};
+
+/* the paths in core_cache_t are referred by the others */
+struct cache_t : core_cache_t {
+	sharded_map_t<path_id_t, display_t> display_cache;
+	sharded_map_t<QString, QString, qstring_hash_t> qstring_cache;
+	sharded_map_t<QByteArray, icon_t, qbytearray_hash_t> icon_cache;
+	std::atomic<std::size_t> qt_memory_size; /* of the three, approximately */
+};
+
+static std::shared_ptr<cache_t> make_cache()
 {
-	return path.startsWith(trash_path) || path.startsWith(recent_documents_path);
+	std::shared_ptr<cache_t> result = std::make_shared<cache_t>();
+	init_core_cache(result.get());
+	return result;
 }
 
-/* QByteArray cache */
-/* Note: QByteArray is reference counted. */
+/* clear_cache() replaces the whole, and the threads in match() keep using
+   the snapshot they got */
 
-typedef std::set<QByteArray> QByteArray_set_t;
+static std::mutex current_cache_mutex;
+static std::shared_ptr<cache_t> current_cache = make_cache();
 
-static QByteArray_set_t qbytearray_cache;
+static std::shared_ptr<cache_t> get_cache()
+{
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	return current_cache;
+}
 
-static QByteArray const &get_unique_qbytearray(QByteArray &&value)
+static void clear_cache()
 {
-	std::pair<QByteArray_set_t::iterator, bool> emplaced =
-		qbytearray_cache.emplace(std::move(value));
-	return *emplaced.first;
+#ifdef LOGGING
+	qDebug("%s: clear_cache.", log_name);
+#endif
+	
+	std::shared_ptr<cache_t> empty = make_cache();
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	current_cache.swap(empty);
 }
 
-/* locate cache */
+/* replacing the cache only if it is not replaced by the others since old */
+static bool replace_cache(
+	std::shared_ptr<cache_t> const &old, std::shared_ptr<cache_t> cache
+)
+{
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	if(current_cache != old) return false;
+	current_cache.swap(cache);
+	return true;
+}
 
-typedef std::map<locate_query_t, std::forward_list<QByteArray>> locate_cache_t;
-static locate_cache_t locate_cache;
+/* persistent cache */
+/* The hottest results of locate are saved at exit and after revalidation,
+   and the next session reads them from the mapped file while the database
+   is not changed. */
 
-static std::forward_list<QByteArray> const *locate_with_cache(
-	locate_query_t const *locate_query)
+static std::size_t const stored_queries = 64;
+
+static std::shared_ptr<locate_store_t const> current_store; /* nullable */
+
+static QByteArray store_path()
 {
-	std::pair<locate_cache_t::iterator, bool> emplaced =
-		locate_cache.try_emplace(*locate_query);
-	locate_cache_t::iterator iter = emplaced.first;
-	if(emplaced.second){
-		int status;
-		int error = locate(
-			locate_query->pattern,
-			locate_query->base_name,
-			locate_query->ignore_case,
-			[iter](std::string_view item){
-				QByteArray bytearray(item.data(), item.size());
-				if(! excluded(bytearray)){
-					iter->second.push_front(get_unique_qbytearray(std::move(bytearray)));
-						/* descending order */
-				}
-				return 0;
-			},
-			&status
-		);
-		if(error != 0){
-			iter->second.clear();
+	return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+		.toUtf8() + QByteArrayLiteral("/krunner_locate.cache");
+}
+
+static void open_store()
+{
+	std::time_t mtime;
+	if(locate_mtime(&mtime) != 0) return;
+	locate_store_t store;
+	[[maybe_unused]] int error = open_locate_store(store_path().constData(), mtime, &store);
+	
+#ifdef LOGGING
+	qDebug("%s: open_locate_store: %s", log_name, std::strerror(error));
+#endif
+	
+	if(error != 0) return;
+	std::shared_ptr<locate_store_t const> opened(
+		new locate_store_t(store),
+		[](locate_store_t const *p){
+			close_locate_store(const_cast<locate_store_t *>(p));
+			delete p;
 		}
-	}
-	return &iter->second;
+	);
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	current_store.swap(opened);
 }
 
-/* query cache */
+/* unmapped after the threads reading it finish */
+static void close_store()
+{
+	std::shared_ptr<locate_store_t const> closed;
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	current_store.swap(closed);
+}
 
-static QString const hidden_icon = QStringLiteral("view-hidden");
+static std::shared_ptr<locate_store_t const> get_store()
+{
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	return current_store;
+}
 
-static bool hidden(QByteArray const &path)
+static void save_store(cache_t const *cache)
 {
-	return path.contains(QByteArrayLiteral("/."));
+	if(cache->database_mtime == -1) return;
+	std::vector<locate_query_t> keys = cache->locate_cache.hottest(stored_queries);
+	std::vector<std::shared_ptr<located_t const>> values; /* keeping the lists */
+	std::vector<stored_locate_t> results;
+	for(
+		std::vector<locate_query_t>::const_iterator i = keys.cbegin();
+		i != keys.cend();
+		++ i
+	){
+		std::shared_ptr<located_t const> value = cache->locate_cache.peek(*i);
+		if(value == nullptr || value->stopped || value->partial){
+			continue; /* stopped for the query, or cancelled */
+		}
+		stored_locate_t result;
+		result.query = &*i;
+		result.complete = value->complete;
+		result.list.reserve(value->list.size());
+		for(
+			std::vector<path_id_t>::const_iterator j = value->list.cbegin();
+			j != value->list.cend();
+			++ j
+		){
+			result.list.push_back(cache->paths.get(*j));
+		}
+		result.types = value->types;
+		results.push_back(std::move(result));
+		values.push_back(std::move(value));
+	}
+	if(results.empty()) return; /* keeping the last one */
+	[[maybe_unused]] int error = write_locate_store(
+		store_path().constData(), cache->database_mtime,
+		locate_limit.load(std::memory_order_relaxed), &results
+	);
+	
+#ifdef LOGGING
+	qDebug("%s: write_locate_store: %zu, %s", log_name, results.size(), std::strerror(error));
+#endif
 }
 
-static std::size_t count_units(QByteArray const &x, int position, int n);
+/* helper process */
 
-static bool lt(QByteArray const &left, QByteArray const &right)
+#ifndef LOCATE_HELPER_PATH
+#define LOCATE_HELPER_PATH "/usr/libexec/krunner_locate_helper"
+#endif
+
+static std::mutex locate_helper_mutex;
+static std::shared_ptr<locate_helper_t> current_locate_helper; /* nullable */
+static bool locate_helper_enabled = false;
+static std::chrono::steady_clock::time_point next_helper_start;
+static unsigned helper_failures = 0; /* since enabled */
+static unsigned const max_helper_backoff = 6; /* 64 seconds */
+
+/* null on failure */
+static std::shared_ptr<locate_helper_t> start_helper()
 {
-	bool l_not_in_home = ! left.startsWith(home_path);
-	bool r_not_in_home = ! right.startsWith(home_path);
-	if(l_not_in_home != r_not_in_home){
-		return l_not_in_home < r_not_in_home;
-	}
+	locate_helper_t *started = new locate_helper_t;
+	[[maybe_unused]] int error = start_locate_helper(LOCATE_HELPER_PATH, started);
 	
-	bool l_hidden = hidden(left);
-	bool r_hidden = hidden(right);
-	if(l_hidden != r_hidden){
-		return l_hidden < r_hidden;
-	}
+#ifdef LOGGING
+	qDebug("%s: start_locate_helper: %s", log_name, std::strerror(error));
+#endif
 	
-	int l_sep = left.lastIndexOf('/');
-	int r_sep = right.lastIndexOf('/');
-	if(l_sep < 0 || r_sep < 0){
-		return false; /* something wrong */
+	if(error != 0){
+		delete started;
+		return nullptr;
 	}
-	
-	std::size_t l_base_name_count =
-		count_units(left, l_sep + 1, left.size() - (l_sep + 1));
-	std::size_t r_base_name_count =
-		count_units(right, r_sep + 1, right.size() - (r_sep + 1));
-	if(l_base_name_count != r_base_name_count){
-		return l_base_name_count < r_base_name_count;
+	return std::shared_ptr<locate_helper_t>(
+		started,
+		[](locate_helper_t *p){
+			stop_locate_helper(p);
+			delete p;
+		}
+	);
+}
+
+/* a lost or not started helper is started again, waiting longer after
+   each failure, the old one is stopped after the threads using it finish */
+static std::shared_ptr<locate_helper_t> get_locate_helper()
+{
+	std::shared_ptr<locate_helper_t> old; /* released after the lock */
+	std::lock_guard<std::mutex> lock(locate_helper_mutex);
+	if(! locate_helper_enabled) return current_locate_helper;
+	if(current_locate_helper != nullptr && ! locate_helper_broken(current_locate_helper.get())){
+		return current_locate_helper;
 	}
+	auto now = std::chrono::steady_clock::now();
+	if(now < next_helper_start) return nullptr;
 	
-	std::size_t l_dir_name_count = count_units(left, 0, l_sep);
-	std::size_t r_dir_name_count = count_units(right, 0, r_sep);
-	if(l_dir_name_count != r_dir_name_count){
-		return l_dir_name_count < r_dir_name_count;
+	old = std::move(current_locate_helper);
+	if(old != nullptr) ++ helper_failures; /* lost */
+	current_locate_helper = start_helper();
+	if(current_locate_helper == nullptr) ++ helper_failures;
+	if(helper_failures != 0){
+		unsigned backoff = std::min(helper_failures, max_helper_backoff);
+		next_helper_start = now + std::chrono::seconds(1u << (backoff - 1));
 	}
-	
-	return false;
-		/* std::forward_list::sort preserves the order of equivalent elements */
+	return current_locate_helper;
 }
 
-static std::time_t const interval = 60;
+static void set_locate_helper(bool enabled)
+{
+	std::shared_ptr<locate_helper_t> old;
+	{
+		std::lock_guard<std::mutex> lock(locate_helper_mutex);
+		if(enabled == locate_helper_enabled) return;
+		locate_helper_enabled = enabled;
+		helper_failures = 0;
+		next_helper_start = std::chrono::steady_clock::time_point();
+		old = std::move(current_locate_helper);
+	}
+	if(enabled) get_locate_helper();
+}
 
-struct queried_t {
-	std::forward_list<QByteArray> list;
-	std::size_t max_length;
-	std::time_t last_checked_time;
-	
-	queried_t() = default;
-	queried_t(queried_t &&) = default;
-};
+/* trigram index */
+/* The index of all paths is made from the output of locate in background
+   once for each generation of the database, then the queries read only the
+   blocks of paths that may match. */
 
-typedef std::map<query_t, queried_t> query_cache_t;
-static query_cache_t query_cache;
+static std::mutex index_mutex;
+static std::thread index_thread;
+static std::atomic<std::uint64_t> index_generation = 0;
+static std::atomic<bool> index_enabled = false;
+static std::shared_ptr<path_index_t const> current_index; /* nullable */
 
-static queried_t const *query_with_cache(query_t &&query, std::time_t now)
+static QByteArray index_path()
 {
-	std::pair<query_cache_t::iterator, bool> emplaced =
-		query_cache.try_emplace(std::move(query));
-	query_cache_t::iterator iter = emplaced.first;
-	if(emplaced.second){
-		std::forward_list<QByteArray> const *list =
-			locate_with_cache(&iter->first.locate_query);
-		std::size_t n = 0;
-		for(
-			std::forward_list<QByteArray>::const_iterator i = list->cbegin();
-			i != list->cend();
-			++ i
-		){
-			if(filter_query(stringview_of_qbytearray(&*i), &iter->first)){
-				iter->second.list.push_front(*i); /* ascending order */
-				++ n;
-			}
+	return QStandardPaths::writableLocation(QStandardPaths::GenericCacheLocation)
+		.toUtf8() + QByteArrayLiteral("/krunner_locate.index");
+}
+
+static std::shared_ptr<path_index_t const> get_index()
+{
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	return current_index;
+}
+
+static void build_index(std::uint64_t generation)
+{
+	auto cancelled = [generation](){
+		return index_generation.load() != generation;
+	};
+	std::time_t mtime;
+	if(locate_mtime(&mtime) != 0) return;
+	QByteArray const path = index_path();
+	path_index_t index;
+	int error = open_path_index(path.constData(), mtime, &index);
+	if(error != 0){
+		error = build_path_index(path.constData(), mtime, make_locate_cancelled(cancelled));
+		if(error == 0){
+			error = open_path_index(path.constData(), mtime, &index);
 		}
-		iter->second.list.sort(lt);
-		iter->second.max_length = n;
-		iter->second.last_checked_time = now;
-	}else if(now - iter->second.last_checked_time > interval){
-		/* remove the paths removed after those were cached */
-		iter->second.list.remove_if(
-			[&query](QByteArray const &item){
-				return ! refilter_query(stringview_of_qbytearray(&item), &query);
-			}
+	}
+	
+#ifdef LOGGING
+	qDebug("%s: build_index: %s", log_name, std::strerror(error));
+#endif
+	
+	if(error != 0) return;
+	std::shared_ptr<path_index_t const> opened(
+		new path_index_t(index),
+		[](path_index_t const *p){
+			close_path_index(const_cast<path_index_t *>(p));
+			delete p;
+		}
+	);
+	std::lock_guard<std::mutex> lock(current_cache_mutex);
+	if(! cancelled()){
+		current_index.swap(opened);
+	}
+}
+
+/* dropping the index, and making it again for the current database if enabled,
+   the old one is unmapped after the threads reading it finish */
+static void update_index(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(index_mutex);
+	index_enabled.store(enabled);
+	std::uint64_t generation = ++ index_generation; /* cancelling the last */
+	if(index_thread.joinable()){
+		index_thread.join();
+	}
+	{
+		std::shared_ptr<path_index_t const> closed;
+		std::lock_guard<std::mutex> lock(current_cache_mutex);
+		current_index.swap(closed);
+	}
+	if(enabled){
+		try{
+			index_thread = std::thread(build_index, generation);
+		}catch(std::system_error const &){
+			/* without the index */
+		}
+	}
+}
+
+/* path pool */
+
+/* valid while the cache is alive */
+static QByteArray qbytearray_of_path(cache_t const *cache, path_id_t path)
+{
+	std::string_view item = cache->paths.get(path);
+	return QByteArray::fromRawData(item.data(), item.size());
+}
+
+/* query cache */
+
+/* the settings and the sources at this time */
+static void make_context(core_context_t *result)
+{
+	result->home = &home_paths;
+	result->match_limit = match_limit.load(std::memory_order_relaxed);
+	result->locate_limit = locate_limit.load(std::memory_order_relaxed);
+	result->store = get_store();
+	result->index = get_index();
+	result->helper = get_locate_helper();
+	result->overlay = home_watched.load(std::memory_order_relaxed) ? &home_overlay : nullptr;
+	result->post = [](std::function<void ()> work){
+		background_pool.start(std::move(work));
+	};
+}
+
+/* display cache */
+
+/* a QUrl holds its parts as QString, about the same as id */
+static std::size_t display_memory_size(display_t const *display)
+{
+	return sizeof(path_id_t) + sizeof(display_t)
+		+ (2 * display->id.size() + display->text.size() + display->subtext.size())
+			* sizeof(QChar);
+}
+
+static display_t display_with_cache(cache_t *cache, ranked_t const *ranked)
+{
+	display_t result;
+	if(! cache->display_cache.find(ranked->path, &result)){
+		QByteArray const path = qbytearray_of_path(cache, ranked->path);
+		int sep = ranked->base_name_position - 1;
+		result.url = QUrl(
+			QStringLiteral("file://")
+				+ QString::fromLatin1(path.toPercentEncoding(QByteArrayLiteral("/"))),
+			QUrl::StrictMode
 		);
-		iter->second.last_checked_time = now;
+		result.id = result.url.toString();
+		int base_name_length = path.size() - (sep + 1);
+		char const *base_name = path.data() + (path.size() - base_name_length);
+		result.text = QString::fromUtf8(base_name, base_name_length);
+		if(! ranked->not_in_home){
+			int position = home_paths.home.size() - 1;
+			QByteArray dir_name;
+			dir_name.reserve(2 + sep - home_paths.home.size());
+			dir_name.append('~');
+			dir_name.append(path.data() + position, sep - position);
+			result.subtext = QString::fromUtf8(dir_name.constData(), dir_name.size());
+		}else{
+			result.subtext = QString::fromUtf8(path.constData(), sep);
+		}
+		/* counted twice if another thread made it at the same time */
+		cache->qt_memory_size.fetch_add(display_memory_size(&result), std::memory_order_relaxed);
+		result = cache->display_cache.emplace(ranked->path, std::move(result));
 	}
-	return &iter->second;
+	return result;
 }
 
 /* QString cache */
-/* Note: QString is reference counted. */
 
-typedef std::set<QString> QString_set_t;
+static QString get_unique_qstring(cache_t *cache, QString &&value)
+{
+	QString key = value;
+	QString result = cache->qstring_cache.emplace(key, std::move(value));
+	if(result.constData() == key.constData()){
+		/* inserted, the key shares the data with the value */
+		cache->qt_memory_size.fetch_add(
+			2 * sizeof(QString) + key.size() * sizeof(QChar), std::memory_order_relaxed
+		);
+	}
+	return result;
+}
+
+/* icon cache */
+/* The first level is by the extension, long-lived and shared by the caches.
+   The others (without known extension, directories which may be special
+   locations) are looked up by the path in background, and a generic icon is
+   used until then. */
 
-static QString_set_t qstring_cache;
+static QString const hidden_icon = QStringLiteral("view-hidden");
+static QString const unknown_icon = QStringLiteral("unknown");
+static QString const folder_icon = QStringLiteral("folder");
+
+/* an empty value means that the extension is ambiguous */
+static sharded_map_t<QString, QString, qstring_hash_t> extension_icon_cache;
 
-static QString const &get_unique_qstring(QString &&value)
+static bool icon_by_extension(QString const &extension, QString *result)
 {
-	std::pair<QString_set_t::iterator, bool> emplaced =
-		qstring_cache.emplace(std::move(value));
-	return *emplaced.first;
+	if(! extension_icon_cache.find(extension, result)){
+		QList<QMimeType> types =
+			QMimeDatabase().mimeTypesForFileName(QStringLiteral("x.") + extension);
+		QString icon_name;
+		if(types.size() == 1){
+			/* the theme may not have the specific one */
+			icon_name = types.first().iconName();
+			if(! QIcon::hasThemeIcon(icon_name)){
+				icon_name = types.first().genericIconName();
+			}
+		}
+		*result = extension_icon_cache.emplace(extension, std::move(icon_name));
+	}
+	return ! result->isEmpty();
 }
 
-/* icon cache */
+/* trying the last two extensions (like ".tar.gz") and the last one */
+static bool icon_by_name(QByteArray const &path, int base_name_position, QString *result)
+{
+	int last_dot = path.lastIndexOf('.');
+	if(last_dot <= base_name_position){
+		return false; /* no extension, or a dot file */
+	}
+	int dot = path.lastIndexOf('.', last_dot - 1);
+	if(
+		dot > base_name_position
+		&& icon_by_extension(
+			QString::fromUtf8(path.constData() + dot + 1, path.size() - (dot + 1)),
+			result
+		)
+	){
+		return true;
+	}
+	return icon_by_extension(
+		QString::fromUtf8(path.constData() + last_dot + 1, path.size() - (last_dot + 1)),
+		result
+	);
+}
 
-struct icon_t {
-	QString icon_name;
-	std::time_t last_checked_time;
+static void look_up_icon(
+	std::shared_ptr<cache_t> cache, QByteArray path, QUrl url, std::time_t now
+)
+{
+	icon_t icon;
+	icon.icon_name = get_unique_qstring(cache.get(), KIO::iconNameForUrl(url));
+	icon.last_checked_time = now;
 	
-	icon_t() = default;
-	icon_t(icon_t &&) = default;
-};
+#ifdef LOGGING
+	qDebug(
+		"%s: look_up_icon: %.*s, %s",
+		log_name, path.size(), path.data(), qPrintable(icon.icon_name)
+	);
+#endif
+	
+	cache->icon_cache.insert_or_assign(path, std::move(icon));
+}
 
-typedef std::map<QByteArray, icon_t> icon_cache_t;
-static icon_cache_t icon_cache;
+/* the icon name is shared by qstring_cache */
+static std::size_t icon_memory_size(QByteArray const &path)
+{
+	return sizeof(QByteArray) + path.size() + sizeof(icon_t);
+}
 
-static QString const &icon_with_cache(
+static QString icon_with_cache(
+	std::shared_ptr<cache_t> const &cache, ranked_t const *ranked,
 	QByteArray const &path, QUrl const &url, std::time_t now
 )
 {
-	if(hidden(path)){
-		return hidden_icon;
+	QString result;
+	if(ranked->hidden){
+		result = hidden_icon;
+	}else if(! ranked->directory && icon_by_name(path, ranked->base_name_position, &result)){
+		/* found by the extension */
 	}else{
-		std::pair<icon_cache_t::iterator, bool> emplaced =
-			icon_cache.try_emplace(path);
-		icon_cache_t::iterator iter = emplaced.first;
-		if(emplaced.second){ /* || now - iter->second.last_checked_time > interval */
-			iter->second.icon_name = get_unique_qstring(KIO::iconNameForUrl(url));
-			iter->second.last_checked_time = now;
-			
-#ifdef LOGGING
-			qDebug(
-				"%s: icon_with_cache: %.*s, %s",
-				log_name, path.size(), path.data(), qPrintable(iter->second.icon_name)
+		icon_t icon;
+		if(! cache->icon_cache.find(path, &icon)){
+			/* an empty icon name means pending */
+			icon.last_checked_time = now;
+			cache->qt_memory_size.fetch_add(icon_memory_size(path), std::memory_order_relaxed);
+			cache->icon_cache.emplace(path, std::move(icon));
+			background_pool.start(
+				[cache, path, url, now](){ look_up_icon(cache, path, url, now); }
 			);
-#endif
 		}
-		return iter->second.icon_name;
+		if(! icon.icon_name.isEmpty()){
+			result = icon.icon_name;
+		}else if(ranked->directory){
+			result = folder_icon;
+		}else{
+			result = unknown_icon;
+		}
 	}
+	return result;
 }
 
-static void clear_old_icon_cache(std::time_t now)
+static std::atomic<std::time_t> icon_cache_cleared_time = 0;
+
+/* at most once in interval, not scanning all the shards by each match() */
+static void clear_old_icon_cache(cache_t *cache, std::time_t now)
 {
-#ifdef LOGGING
-	icon_cache_t::size_type old_size = icon_cache.size();
-#endif
+	std::time_t cleared_time = icon_cache_cleared_time.load(std::memory_order_relaxed);
+	if(
+		now - cleared_time <= interval
+		|| ! icon_cache_cleared_time.compare_exchange_strong(cleared_time, now)
+	){
+		return;
+	}
 	
-	std::erase_if(
-		icon_cache,
-		[now](icon_cache_t::value_type const &item){
-			return now - item.second.last_checked_time > interval;
+	[[maybe_unused]] std::size_t erased = cache->icon_cache.erase_if(
+		[cache, now](std::pair<QByteArray const, icon_t> const &item){
+			if(now - item.second.last_checked_time <= interval) return false;
+			cache->qt_memory_size.fetch_sub(
+				icon_memory_size(item.first), std::memory_order_relaxed
+			);
+			return true;
 		}
 	);
 	
 #ifdef LOGGING
-	if(icon_cache.size() != old_size){
+	if(erased > 0){
 		qDebug("%s: clear_old_icon_cache.", log_name);
 	}
 #endif
 }
 
-static void clear_cache()
+/* memory budget */
+
+/* display_cache and qstring_cache are freed only with the whole cache as the paths */
+static void trim_cache(cache_t *cache)
 {
+	std::size_t budget = cache_budget.load(std::memory_order_relaxed);
+	std::size_t qt_size = cache->qt_memory_size.load(std::memory_order_relaxed);
+	std::size_t core_budget = budget > qt_size ? budget - qt_size : 0;
+	[[maybe_unused]] std::size_t evicted = trim_core_cache(cache, core_budget);
+	
 #ifdef LOGGING
-	qDebug("%s: clear_cache.", log_name);
+	if(evicted > 0){
+		cache_statistics_t locate_statistics = cache->locate_cache.statistics();
+		cache_statistics_t query_statistics = cache->query_cache.statistics();
+		qDebug(
+			"%s: trim_cache: locate %zu entries, %zu bytes, %zu hits, %zu misses, "
+				"%zu evictions; query %zu entries, %zu bytes, %zu hits, %zu misses, "
+				"%zu evictions; %zu paths, %zu bytes; Qt %zu bytes.",
+			log_name,
+			locate_statistics.entries, locate_statistics.bytes, locate_statistics.hits,
+			locate_statistics.misses, locate_statistics.evictions,
+			query_statistics.entries, query_statistics.bytes, query_statistics.hits,
+			query_statistics.misses, query_statistics.evictions,
+			cache->paths.size(), cache->paths.memory_size(), qt_size
+		);
+	}
 #endif
 	
-	icon_cache.clear();
-	qstring_cache.clear();
-	query_cache.clear();
-	locate_cache.clear();
-	qbytearray_cache.clear();
+	if(cache->paths.memory_size() > core_budget){
+		clear_cache();
+	}
 }
 
 /* modification time */
@@ -326,7 +717,75 @@ static int get_now(std::time_t *time)
 	return 0;
 }
 
-static std::time_t last_locate_mtime = -1;
+/* revalidation after updatedb */
+/* The hottest queries are run again with the new database in background,
+   while match() uses the old cache. */
+
+static std::size_t const revalidated_queries = 16;
+
+static std::mutex revalidation_mutex;
+static std::thread revalidation_thread;
+static std::atomic<std::uint64_t> revalidation_generation = 0;
+
+static void revalidate(std::shared_ptr<cache_t> old, std::uint64_t generation)
+{
+	auto cancelled = [generation](){
+		return revalidation_generation.load() != generation;
+	};
+	std::time_t now;
+	if(get_now(&now) != 0){
+		now = 0; /* error */
+	}
+	core_context_t context;
+	make_context(&context);
+	std::shared_ptr<cache_t> cache = make_cache();
+	std::vector<query_t> queries = old->query_cache.hottest(revalidated_queries);
+	for(
+		std::vector<query_t>::const_iterator i = queries.cbegin();
+		i != queries.cend() && ! cancelled();
+		++ i
+	){
+		query_with_cache(cache, &context, &*i, now, make_locate_cancelled(cancelled));
+	}
+	if(! cancelled()){
+		bool replaced = replace_cache(old, cache);
+		
+#ifdef LOGGING
+		qDebug("%s: revalidate: %zu, %d.", log_name, queries.size(), replaced);
+#endif
+		
+		if(replaced){
+			save_store(cache.get());
+		}
+	}
+}
+
+static void start_revalidation()
+{
+	close_store(); /* made from the old database */
+	update_index(index_enabled.load());
+	std::lock_guard<std::mutex> lock(revalidation_mutex);
+	std::uint64_t generation = ++ revalidation_generation; /* cancelling the last */
+	if(revalidation_thread.joinable()){
+		revalidation_thread.join();
+	}
+	try{
+		revalidation_thread = std::thread(revalidate, get_cache(), generation);
+	}catch(std::system_error const &){
+		clear_cache();
+	}
+}
+
+static void stop_revalidation()
+{
+	std::lock_guard<std::mutex> lock(revalidation_mutex);
+	++ revalidation_generation;
+	if(revalidation_thread.joinable()){
+		revalidation_thread.join();
+	}
+}
+
+static std::atomic<std::time_t> last_locate_mtime = -1;
 
 static bool check_locate_mtime()
 {
@@ -334,23 +793,116 @@ static bool check_locate_mtime()
 	if(locate_mtime(&mtime) != 0){
 		return false; /* error */
 	}
-	bool modified = mtime != last_locate_mtime;
-	if(modified){ /* updatedb is executed */
-		clear_cache();
-		last_locate_mtime = mtime;
+	std::time_t old = last_locate_mtime.exchange(mtime);
+	bool modified = mtime != old;
+	if(modified && old != -1){ /* updatedb is executed */
+		start_revalidation();
 	}
 	return modified;
 }
 
-static std::time_t last_use_time = -(interval + 1);
+static std::atomic<std::time_t> last_use_time = -(interval + 1);
 
 static bool update_time(std::time_t now)
 {
-	std::time_t old = last_use_time;
-	last_use_time = now;
+	std::time_t old = last_use_time.exchange(now);
 	return now - old > interval;
 }
 
+/* watching the database, or else polling the modification time in match() */
+
+static std::mutex database_watch_mutex;
+static std::size_t database_watch_users = 0;
+static locate_watch_t database_watch;
+static std::atomic<bool> database_watched = false;
+
+static void database_modified()
+{
+#ifdef LOGGING
+	qDebug("%s: database_modified.", log_name);
+#endif
+	
+	home_overlay.clear();
+	start_revalidation();
+}
+
+static void start_database_watch()
+{
+	std::lock_guard<std::mutex> lock(database_watch_mutex);
+	if(database_watch_users ++ == 0){
+		[[maybe_unused]] int error = start_locate_watch(database_modified, &database_watch);
+		database_watched.store(error == 0);
+		
+#ifdef LOGGING
+		if(error != 0){
+			qDebug("%s: start_locate_watch: %s", log_name, std::strerror(error));
+		}
+#endif
+	}
+}
+
+/* the thread should be joined before the plugin is unloaded */
+static void stop_database_watch()
+{
+	std::lock_guard<std::mutex> lock(database_watch_mutex);
+	if(-- database_watch_users == 0 && database_watched.load()){
+		stop_locate_watch(&database_watch);
+		database_watched.store(false);
+	}
+}
+
+/* watching home */
+
+static std::mutex home_watch_mutex;
+static home_watch_t home_watch;
+
+static void set_home_watch(bool enabled)
+{
+	std::lock_guard<std::mutex> lock(home_watch_mutex);
+	if(enabled == home_watched.load()) return;
+	if(enabled){
+		std::vector<std::string> excluded{home_paths.trash, home_paths.recent_documents};
+		[[maybe_unused]] int error =
+			start_home_watch(home_paths.home, std::move(excluded), &home_overlay, &home_watch);
+		if(error == 0){
+			home_watched.store(true);
+		}
+		
+#ifdef LOGGING
+		if(error != 0){
+			qDebug("%s: start_home_watch: %s", log_name, std::strerror(error));
+		}
+#endif
+	}else{
+		stop_home_watch(&home_watch);
+		home_watched.store(false);
+		/* the merged changes are no longer maintained */
+		home_overlay.clear();
+		clear_cache();
+	}
+}
+
+/* tracing */
+/* The spans and the counters are summarized to
+   $XDG_RUNTIME_DIR/krunner_locate.trace every second while enabled. */
+
+static void set_trace(bool enabled)
+{
+	if(enabled){
+		QString const directory =
+			QStandardPaths::writableLocation(QStandardPaths::RuntimeLocation);
+		if(directory.isEmpty()) return;
+		QByteArray const path = directory.toUtf8() + QByteArrayLiteral("/krunner_locate.trace");
+		[[maybe_unused]] int error = start_trace(path.constData());
+		
+#ifdef LOGGING
+		qDebug("%s: start_trace: %s", log_name, std::strerror(error));
+#endif
+	}else{
+		stop_trace();
+	}
+}
+
 /* LocateRunner */
 
 static QString const open_folder_icon = QStringLiteral("document-open-folder");
@@ -371,7 +923,24 @@ LocateRunner::LocateRunner(
 #endif
 	
 	/* miscellany initialization */
+	background_pool.setMaxThreadCount(background_threads);
 	setup_home_path();
+	start_database_watch();
+	open_store();
+}
+
+LocateRunner::~LocateRunner()
+{
+	set_trace(false);
+	/* nothing posts the work after these */
+	stop_database_watch();
+	stop_revalidation();
+	background_pool.clear();
+	background_pool.waitForDone();
+	set_locate_helper(false);
+	update_index(false);
+	set_home_watch(false);
+	save_store(get_cache().get());
 }
 
 void LocateRunner::reloadConfiguration()
@@ -382,6 +951,38 @@ void LocateRunner::reloadConfiguration()
 	
 	this->setMatchRegex(QRegularExpression(QStringLiteral("[*./?]")));
 	this->setMinLetterCount(2);
+	
+	std::size_t budget_mib = this->config().readEntry(
+		"cacheBudgetMiB", static_cast<qulonglong>(default_cache_budget_mib)
+	);
+	cache_budget.store(budget_mib << 20, std::memory_order_relaxed);
+	
+	/* the cached results depend on the limits */
+	std::size_t limit = std::max(
+		this->config().readEntry(
+			"maxMatches", static_cast<qulonglong>(default_match_limit)
+		),
+		qulonglong{1}
+	);
+	bool modified = match_limit.exchange(limit) != limit;
+	limit = std::max(
+		this->config().readEntry(
+			"locateLimit", static_cast<qulonglong>(default_locate_limit)
+		),
+		qulonglong{1}
+	);
+	modified |= locate_limit.exchange(limit) != limit;
+	if(modified){
+		clear_cache();
+	}
+	
+	set_home_watch(this->config().readEntry("watchHome", false));
+	set_locate_helper(this->config().readEntry("locateHelper", false));
+	set_trace(this->config().readEntry("trace", false));
+	bool indexed = this->config().readEntry("trigramIndex", false);
+	if(indexed != index_enabled.load()){
+		update_index(indexed);
+	}
 }
 
 void LocateRunner::match(KRunner::RunnerContext &context)
@@ -392,64 +993,67 @@ void LocateRunner::match(KRunner::RunnerContext &context)
 #endif
 	
 	std::time_t now;
+	bool cleared;
 	if(get_now(&now) != 0){
 		now = 0; /* error */
+		cleared = false;
+	}else if(! database_watched.load() && update_time(now)){
+		cleared = check_locate_mtime();
 	}else{
-		bool cleared;
-		if(update_time(now)){
-			cleared = check_locate_mtime();
-		}else{
-			cleared = false;
-		}
-		if(! cleared){
-			clear_old_icon_cache(now);
-		}
+		cleared = false;
+	}
+	std::shared_ptr<cache_t> cache = get_cache();
+	if(now != 0 && ! cleared){
+		clear_old_icon_cache(cache.get(), now);
 	}
 	
 	QByteArray query_utf8 = query_string.toUtf8();
 	query_t query;
+	std::uint64_t start = trace_begin();
 	parse_query(stringview_of_qbytearray(&query_utf8), &query);
-	queried_t const *queried = query_with_cache(std::move(query), now);
-	double n = 0.;
-	for(
-		std::forward_list<QByteArray>::const_iterator iter = queried->list.cbegin();
-		iter != queried->list.cend();
-		++ iter
-	){
-		int sep = iter->lastIndexOf('/');
-		if(sep >= 0){
-			QUrl url(
-				QStringLiteral("file://")
-					+ QString::fromLatin1(iter->toPercentEncoding(QByteArrayLiteral("/"))),
-				QUrl::StrictMode
-			);
-			int base_name_length = iter->size() - (sep + 1);
-			char const *base_name = iter->data() + (iter->size() - base_name_length);
-			int dir_name_length;
-			QByteArray dir_name;
-			if(iter->startsWith(home_path)){
-				dir_name_length = 2 + sep - home_path.size();
-				int position = home_path.size() - 1;
-				dir_name.reserve(dir_name_length);
-				dir_name.append('~');
-				dir_name.append(iter->data() + position, sep - position);
-			}else{
-				dir_name_length = sep;
-				dir_name = *iter;
-			}
-			double relevance = 0.25 * (1. - n / queried->max_length); /* keep sorted */
+	trace_end(ts_parse, start);
+	/* KRunner has moved to another query */
+	auto cancelled = [&context](){ return ! context.isValid(); };
+	core_context_t core_context;
+	make_context(&core_context);
+	std::size_t limit = core_context.match_limit;
+	std::shared_ptr<queried_t const> queried = query_with_cache(
+		cache, &core_context, &query, now, make_locate_cancelled(cancelled)
+	);
+	trim_cache(cache.get());
+	if(queried == nullptr){
+#ifdef LOGGING
+		qDebug("%s: match: cancelled.", log_name);
+#endif
+		return;
+	}
+	/* only the sorted ones are shown */
+	std::size_t n = std::min(limit, queried->sorted_length);
+	start = trace_begin();
+	QList<KRunner::QueryMatch> matches;
+	matches.reserve(n);
+	for(std::size_t i = 0; i < n && ! cancelled(); ++ i){
+		ranked_t const *ranked = &queried->list[i];
+		if(ranked->base_name_position > 0){
+			display_t display = display_with_cache(cache.get(), ranked);
+			QByteArray const path = qbytearray_of_path(cache.get(), ranked->path);
+			double relevance = 0.25 * (1. - static_cast<double>(i) / queried->max_length);
+				/* keep sorted */
 			KRunner::QueryMatch match(this);
-			match.setId(url.toString());
-			match.setUrls(QList<QUrl>{url});
-			match.setText(QString::fromUtf8(base_name, base_name_length));
-			match.setSubtext(QString::fromUtf8(dir_name.constData(), dir_name_length));
-			match.setIconName(icon_with_cache(*iter, url, now));
+			match.setId(display.id);
+			match.setUrls(QList<QUrl>{display.url});
+			match.setText(display.text);
+			match.setSubtext(display.subtext);
+			match.setIconName(icon_with_cache(cache, ranked, path, display.url, now));
 			match.setRelevance(relevance);
 			match.setActions(this->actions);
-			context.addMatch(match);
-			n += 1.;
+			matches.append(match);
 		}
 	}
+	if(! cancelled()){
+		context.addMatches(matches);
+	}
+	trace_end(ts_emit, start, matches.size());
 }
 
 void LocateRunner::run(
@@ -484,21 +1088,6 @@ void LocateRunner::run(
 	}
 }
 
-/* ICU */
-#include <unicode/uiter.h>
-
-static std::size_t count_units(QByteArray const &x, int position, int n)
-{
-	std::size_t result = 0;
-	UCharIterator iter;
-	uiter_setUTF8(&iter, x.data() + position, n);
-	while(iter.hasNext(&iter) != 0){
-		iter.next(&iter);
-		++ result;
-	}
-	return result;
-}
-
 /* moc */
 
 K_PLUGIN_CLASS_WITH_JSON(LocateRunner, "krunner_locate.json")
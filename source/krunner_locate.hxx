@@ -13,6 +13,7 @@ public:
 		QObject *parent, KPluginMetaData const &pluginMetaData,
 		QVariantList const &args
 	);
+	~LocateRunner() override;
 	void reloadConfiguration() override;
 	void match(KRunner::RunnerContext &context) override;
 	void run(
@@ -0,0 +1,17 @@
+#include "use_locate.hxx"
+
+#include <cstdio>
+#include <cstring>
+
+/* started by the plugin with a socket as stdin and stdout,
+   exits when the plugin closes it */
+
+int main(int, char const * const *argv)
+{
+	int error = serve_locate_helper(0);
+	if(error != 0){
+		std::fprintf(stderr, "%s: %s\n", argv[0], std::strerror(error));
+		return 1;
+	}
+	return 0;
+}
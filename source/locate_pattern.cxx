@@ -0,0 +1,201 @@
+#include "locate_pattern.hxx"
+
+#include <cstring>
+
+#include <alloca.h>
+#include <fnmatch.h>
+
+static bool is_wildcard(char c)
+{
+	return c == '*' || c == '?' || c == '[' || c == '\\';
+}
+
+static bool is_ascii(std::string_view s)
+{
+	for(std::string_view::const_iterator i = s.cbegin(); i != s.cend(); ++ i){
+		if(static_cast<unsigned char>(*i) >= 0x80) return false;
+	}
+	return true;
+}
+
+static bool has_wildcard(std::string_view pattern)
+{
+	for(std::string_view::const_iterator i = pattern.cbegin(); i != pattern.cend(); ++ i){
+		if(is_wildcard(*i)) return true;
+	}
+	return false;
+}
+
+void compile_locate_pattern(
+	std::string_view pattern, bool base_name, bool ignore_case,
+	locate_pattern_t *result
+)
+{
+	result->pattern.assign(pattern);
+	result->base_name = base_name;
+	result->ignore_case = ignore_case;
+	result->wildcard = has_wildcard(pattern);
+	result->ascii = is_ascii(pattern);
+}
+
+bool narrower_locate_pattern(std::string_view narrower, std::string_view wider)
+{
+	if(! has_wildcard(wider)){
+		/* both are substrings */
+		return ! has_wildcard(narrower)
+			&& narrower.find(wider) != std::string_view::npos;
+	}else{
+		/* wider = "...*", narrower = wider + "..." */
+		if(! wider.ends_with('*') || ! narrower.starts_with(wider)) return false;
+		if(wider.find('[') != std::string_view::npos){
+			return false; /* the rest may close a bracket */
+		}
+		std::size_t backslashes = 0;
+		for(
+			std::string_view::size_type i = wider.size() - 1;
+			i > 0 && wider[i - 1] == '\\';
+			-- i
+		){
+			++ backslashes;
+		}
+		return backslashes % 2 == 0; /* not an escaped "*" */
+	}
+}
+
+static char ascii_lower(char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c + ('a' - 'A') : c;
+}
+
+static bool contains_ignoring_case(std::string_view s, std::string_view sub)
+{
+	std::size_t sub_length = sub.size();
+	if(sub_length == 0) return true;
+	if(s.size() < sub_length) return false;
+	char first = ascii_lower(sub[0]);
+	std::size_t last = s.size() - sub_length;
+	for(std::size_t i = 0; i <= last; ++ i){
+		if(ascii_lower(s[i]) == first){
+			std::size_t j = 1;
+			while(j < sub_length && ascii_lower(s[i + j]) == ascii_lower(sub[j])){
+				++ j;
+			}
+			if(j == sub_length) return true;
+		}
+	}
+	return false;
+}
+
+bool match_locate_pattern(std::string_view path, locate_pattern_t const *pattern)
+{
+	std::string_view subject = path;
+	if(pattern->base_name){
+		std::string_view::size_type sep = path.rfind('/');
+		if(sep != std::string_view::npos && sep + 1 < path.size()){
+			subject = path.substr(sep + 1);
+		}
+	}
+	
+	if(! pattern->wildcard){
+		if(! pattern->ignore_case){
+			return subject.find(pattern->pattern) != std::string_view::npos;
+		}else if(pattern->ascii){
+			return contains_ignoring_case(subject, pattern->pattern);
+		}
+	}
+	
+	std::size_t subject_length = subject.size();
+	char *c_subject = static_cast<char *>(alloca(subject_length + 1));
+	std::memcpy(c_subject, subject.data(), subject_length);
+	c_subject[subject_length] = '\0';
+	
+	char const *c_pattern;
+	if(pattern->wildcard){
+		c_pattern = pattern->pattern.c_str();
+	}else{
+		/* non-ASCII substring ignoring case */
+		std::size_t pattern_length = pattern->pattern.size();
+		char *p = static_cast<char *>(alloca(pattern_length + 3));
+		p[0] = '*';
+		std::memcpy(p + 1, pattern->pattern.data(), pattern_length);
+		p[pattern_length + 1] = '*';
+		p[pattern_length + 2] = '\0';
+		c_pattern = p;
+	}
+	
+	int flags = 0;
+	if(pattern->ignore_case) flags |= FNM_CASEFOLD;
+	return fnmatch(c_pattern, c_subject, flags) == 0;
+}
+
+/* returns the position of the closing ']', or npos if it is not a bracket */
+static std::string::size_type skip_bracket(
+	std::string const &pattern, std::string::size_type position
+)
+{
+	std::string::size_type i = position + 1;
+	if(i < pattern.size() && (pattern[i] == '!' || pattern[i] == '^')) ++ i;
+	if(i < pattern.size() && pattern[i] == ']') ++ i;
+	while(i < pattern.size() && pattern[i] != ']'){
+		if(
+			pattern[i] == '[' && i + 1 < pattern.size()
+			&& (pattern[i + 1] == ':' || pattern[i + 1] == '.' || pattern[i + 1] == '=')
+		){
+			std::string::size_type close = pattern.find(pattern[i + 1], i + 2);
+			if(
+				close != std::string::npos && close + 1 < pattern.size()
+				&& pattern[close + 1] == ']'
+			){
+				i = close + 2;
+				continue;
+			}
+		}
+		++ i;
+	}
+	return (i < pattern.size()) ? i : std::string::npos;
+}
+
+void literal_fragments(
+	locate_pattern_t const *pattern, std::vector<std::string> *result
+)
+{
+	result->clear();
+	if(! pattern->wildcard){
+		if(! pattern->pattern.empty()) result->push_back(pattern->pattern);
+		return;
+	}
+	
+	std::string fragment;
+	std::string const &p = pattern->pattern;
+	std::string::size_type i = 0;
+	while(i < p.size()){
+		char c = p[i];
+		bool literal = true;
+		if(c == '*' || c == '?'){
+			literal = false;
+			++ i;
+		}else if(c == '['){
+			std::string::size_type close = skip_bracket(p, i);
+			if(close != std::string::npos){
+				literal = false;
+				i = close + 1;
+			}else{
+				++ i;
+			}
+		}else if(c == '\\' && i + 1 < p.size()){
+			c = p[i + 1];
+			i += 2;
+		}else{
+			++ i;
+		}
+		if(literal){
+			fragment.push_back(c);
+		}else if(! fragment.empty()){
+			result->push_back(std::move(fragment));
+			fragment.clear();
+		}
+	}
+	if(! fragment.empty()){
+		result->push_back(std::move(fragment));
+	}
+}
@@ -0,0 +1,36 @@
+#ifndef LOCATE_PATTERN_HXX
+#define LOCATE_PATTERN_HXX
+
+#include <string>
+#include <string_view>
+#include <vector>
+
+/* the matching rule of locate(1) itself:
+   a pattern without wildcards matches as a substring,
+   otherwise it has to match the whole path (or base name) by fnmatch(3) */
+
+struct locate_pattern_t {
+	std::string pattern;
+	bool base_name;
+	bool ignore_case;
+	bool wildcard;
+	bool ascii;
+};
+
+void compile_locate_pattern(
+	std::string_view pattern, bool base_name, bool ignore_case,
+	locate_pattern_t *result
+);
+
+bool match_locate_pattern(std::string_view path, locate_pattern_t const *pattern);
+
+/* whether any path matched by narrower is also matched by wider,
+   with the same base_name and ignore_case */
+bool narrower_locate_pattern(std::string_view narrower, std::string_view wider);
+
+/* the literal parts that any matched path should contain */
+void literal_fragments(
+	locate_pattern_t const *pattern, std::vector<std::string> *result
+);
+
+#endif
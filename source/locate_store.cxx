@@ -0,0 +1,312 @@
+#include "locate_store.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <compare>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <limits>
+#include <string>
+#include <unordered_map>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* layout (native byte order, aligned to 4 bytes)
+   header: "KRLSTORE", uint32 byte order mark, uint32 version (2),
+     int64 mtime of the database, uint64 limit, uint32 number of entries,
+     uint32 offset of entries, uint32 offset of IDs, uint32 size of the file
+   records: {uint32 length, bytes, padding}, the patterns and the paths
+   entries: {uint32 offset of the pattern, uint32 index of the first ID,
+     uint32 number of IDs, uint8 base name, uint8 ignore case, uint8 complete,
+     1 byte padding}, sorted in the order of locate_query_t
+   IDs: uint32 offsets of the paths, locate_type_t in the lower 2 bits */
+
+static char const store_magic[8] = {'K', 'R', 'L', 'S', 'T', 'O', 'R', 'E'};
+static std::uint32_t const store_byte_order = 0x01020304;
+static std::uint32_t const store_version = 2;
+static std::uint32_t const store_type_mask = 3;
+
+static std::size_t const store_header_size = 48;
+static std::size_t const store_entry_size = 16;
+
+static std::uint32_t read_u32(unsigned char const *p)
+{
+	std::uint32_t result;
+	std::memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+static std::uint64_t read_u64(unsigned char const *p)
+{
+	std::uint64_t result;
+	std::memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+static bool read_record(
+	mapped_file_t const *file, std::uint32_t offset, std::string_view *result
+)
+{
+	if(offset > file->size || file->size - offset < sizeof(std::uint32_t)){
+		return false;
+	}
+	std::uint32_t length = read_u32(file->data + offset);
+	if(file->size - offset - sizeof(std::uint32_t) < length) return false;
+	*result = std::string_view(
+		reinterpret_cast<char const *>(file->data + offset + sizeof(std::uint32_t)),
+		length
+	);
+	return true;
+}
+
+int open_locate_store(char const *path, std::time_t mtime, locate_store_t *result)
+{
+	mapped_file_t file;
+	int error;
+	if((error = map_file(path, MADV_RANDOM, &file)) != 0) return error;
+	
+	unsigned char const *p = file.data;
+	if(
+		file.size < store_header_size || std::memcmp(p, store_magic, 8) != 0
+		|| read_u32(p + 8) != store_byte_order || read_u32(p + 12) != store_version
+		|| read_u32(p + 44) != file.size
+	){
+		error = EUNSUPPORTED_DATABASE;
+	}else if(static_cast<std::time_t>(read_u64(p + 16)) != mtime){
+		error = ESTALE;
+	}else{
+		std::uint32_t entry_count = read_u32(p + 32);
+		std::uint32_t entries_offset = read_u32(p + 36);
+		std::uint32_t ids_offset = read_u32(p + 40);
+		if(
+			entries_offset > file.size
+			|| (file.size - entries_offset) / store_entry_size < entry_count
+			|| ids_offset > file.size
+		){
+			error = EUNSUPPORTED_DATABASE;
+		}
+	}
+	if(error != 0){
+		unmap_file(&file);
+		return error;
+	}
+	
+	result->file = file;
+	result->mtime = mtime;
+	result->limit = read_u64(p + 24);
+	return 0;
+}
+
+void close_locate_store(locate_store_t *store)
+{
+	unmap_file(&store->file);
+}
+
+static std::strong_ordering compare_entry(
+	mapped_file_t const *file, unsigned char const *entry,
+	locate_query_t const *query, bool *broken
+)
+{
+	std::string_view pattern;
+	if(! read_record(file, read_u32(entry), &pattern)){
+		*broken = true;
+		return std::strong_ordering::equal;
+	}
+	int r = pattern.compare(query->pattern);
+	if(r != 0) return r <=> 0;
+	bool base_name = entry[12] != 0;
+	if(base_name != query->base_name) return base_name <=> query->base_name;
+	bool ignore_case = entry[13] != 0;
+	return ignore_case <=> query->ignore_case;
+}
+
+int find_locate_store(
+	locate_store_t const *store, locate_query_t const *query, bool *complete,
+	locate_callback_t f
+)
+{
+	mapped_file_t const *file = &store->file;
+	unsigned char const *p = file->data;
+	unsigned char const *entries = p + read_u32(p + 36);
+	std::uint32_t ids_offset = read_u32(p + 40);
+	
+	/* binary search */
+	std::size_t low = 0;
+	std::size_t high = read_u32(p + 32);
+	bool broken = false;
+	while(low < high){
+		std::size_t middle = low + (high - low) / 2;
+		unsigned char const *entry = entries + middle * store_entry_size;
+		std::strong_ordering r = compare_entry(file, entry, query, &broken);
+		if(broken) return EUNSUPPORTED_DATABASE;
+		if(r < 0){
+			low = middle + 1;
+		}else if(r > 0){
+			high = middle;
+		}else{
+			std::uint32_t first = read_u32(entry + 4);
+			std::uint32_t count = read_u32(entry + 8);
+			std::size_t id_count = (file->size - ids_offset) / sizeof(std::uint32_t);
+			if(first > id_count || id_count - first < count){
+				return EUNSUPPORTED_DATABASE;
+			}
+			*complete = entry[14] != 0;
+			unsigned char const *ids = p + ids_offset + first * sizeof(std::uint32_t);
+			for(std::uint32_t i = 0; i < count; ++ i){
+				std::uint32_t id = read_u32(ids + i * sizeof(std::uint32_t));
+				std::string_view path;
+				if(! read_record(file, id & ~store_type_mask, &path)){
+					return EUNSUPPORTED_DATABASE;
+				}
+				locate_type_t type = static_cast<locate_type_t>(id & store_type_mask);
+				if(type > lrt_directory) type = lrt_unknown;
+				int error = f(path, type);
+				if(error != 0) return error;
+			}
+			return 0;
+		}
+	}
+	return ENOENT;
+}
+
+/* writing */
+
+static void append_u32(std::string *buffer, std::uint32_t x)
+{
+	buffer->append(reinterpret_cast<char const *>(&x), sizeof(x));
+}
+
+static void append_u64(std::string *buffer, std::uint64_t x)
+{
+	buffer->append(reinterpret_cast<char const *>(&x), sizeof(x));
+}
+
+static void put_u32(std::string *buffer, std::size_t offset, std::uint32_t x)
+{
+	std::memcpy(buffer->data() + offset, &x, sizeof(x));
+}
+
+/* the records of the same bytes are shared */
+static std::uint32_t append_record(
+	std::string *buffer,
+	std::unordered_map<std::string_view, std::uint32_t> *records,
+	std::string_view x
+)
+{
+	std::pair<std::unordered_map<std::string_view, std::uint32_t>::iterator, bool>
+		emplaced = records->try_emplace(x, buffer->size());
+	if(emplaced.second){
+		append_u32(buffer, x.size());
+		buffer->append(x);
+		buffer->append((4 - buffer->size() % 4) % 4, '\0');
+	}
+	return emplaced.first->second;
+}
+
+static int write_all(int fd, std::string const *buffer)
+{
+	char const *p = buffer->data();
+	std::size_t rest = buffer->size();
+	while(rest > 0){
+		ssize_t r = write(fd, p, rest);
+		if(r < 0){
+			int error;
+			if((error = errno) != EINTR) return nonzero_errno(error);
+			continue;
+		}
+		p += r;
+		rest -= r;
+	}
+	return 0;
+}
+
+int write_locate_store(
+	char const *path, std::time_t mtime, std::size_t limit,
+	std::vector<stored_locate_t> *results
+)
+{
+	std::sort(
+		results->begin(), results->end(),
+		[](stored_locate_t const &left, stored_locate_t const &right){
+			return *left.query < *right.query;
+		}
+	);
+	
+	std::string buffer;
+	buffer.append(store_magic, 8);
+	append_u32(&buffer, store_byte_order);
+	append_u32(&buffer, store_version);
+	append_u64(&buffer, static_cast<std::int64_t>(mtime));
+	append_u64(&buffer, limit);
+	append_u32(&buffer, results->size());
+	buffer.append(store_header_size - buffer.size(), '\0'); /* filled later */
+	
+	/* records */
+	std::unordered_map<std::string_view, std::uint32_t> records;
+	std::vector<std::uint32_t> patterns;
+	std::vector<std::uint32_t> ids;
+	patterns.reserve(results->size());
+	for(
+		std::vector<stored_locate_t>::const_iterator i = results->cbegin();
+		i != results->cend();
+		++ i
+	){
+		patterns.push_back(append_record(&buffer, &records, i->query->pattern));
+		for(std::size_t j = 0; j < i->list.size(); ++ j){
+			ids.push_back(append_record(&buffer, &records, i->list[j]) | i->types[j]);
+		}
+	}
+	
+	/* entries */
+	std::size_t entries_offset = buffer.size();
+	std::uint32_t first = 0;
+	for(std::size_t i = 0; i < results->size(); ++ i){
+		stored_locate_t const &result = (*results)[i];
+		append_u32(&buffer, patterns[i]);
+		append_u32(&buffer, first);
+		append_u32(&buffer, result.list.size());
+		buffer.push_back(result.query->base_name);
+		buffer.push_back(result.query->ignore_case);
+		buffer.push_back(result.complete);
+		buffer.push_back('\0');
+		first += result.list.size();
+	}
+	
+	/* IDs */
+	std::size_t ids_offset = buffer.size();
+	buffer.append(
+		reinterpret_cast<char const *>(ids.data()), ids.size() * sizeof(std::uint32_t)
+	);
+	
+	if(buffer.size() > std::numeric_limits<std::uint32_t>::max()) return EFBIG;
+	put_u32(&buffer, 36, entries_offset);
+	put_u32(&buffer, 40, ids_offset);
+	put_u32(&buffer, 44, buffer.size());
+	
+	/* write */
+	std::string temporary(path);
+	temporary.append(".");
+	temporary.append(std::to_string(getpid()));
+	int fd;
+	while(
+		(fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+			< 0
+	){
+		int error;
+		if((error = errno) != EINTR) return nonzero_errno(error);
+	}
+	int error = write_all(fd, &buffer);
+	if(close(fd) < 0 && error == 0 && errno != EINTR){
+		error = nonzero_errno(errno);
+	}
+	if(error == 0 && std::rename(temporary.c_str(), path) < 0){
+		error = nonzero_errno(errno);
+	}
+	if(error != 0){
+		unlink(temporary.c_str());
+	}
+	return error;
+}
@@ -0,0 +1,48 @@
+#ifndef LOCATE_STORE_HXX
+#define LOCATE_STORE_HXX
+
+#include "mapped_file.hxx"
+#include "query.hxx"
+#include "use_locate.hxx"
+
+#include <cstddef>
+#include <ctime>
+#include <string_view>
+#include <vector>
+
+/* a file of the results of locate kept over the sessions,
+   it is mapped and searched in place without reading the whole */
+
+struct locate_store_t {
+	mapped_file_t file;
+	std::time_t mtime; /* of the database that the results are from */
+	std::size_t limit; /* locate_limit of the results */
+};
+
+/* returns ESTALE if it is made from the other database than mtime,
+   or EUNSUPPORTED_DATABASE if it is not a known version */
+int open_locate_store(char const *path, std::time_t mtime, locate_store_t *result);
+void close_locate_store(locate_store_t *store);
+
+/* calling f(path, type) for each path of the result in the order of locate,
+   returns ENOENT if query is not stored, or the error returned from f */
+int find_locate_store(
+	locate_store_t const *store, locate_query_t const *query, bool *complete,
+	locate_callback_t f
+);
+
+struct stored_locate_t {
+	locate_query_t const *query;
+	bool complete;
+	std::vector<std::string_view> list;
+	std::vector<locate_type_t> types; /* of list */
+};
+
+/* writing to a temporary file and renaming it, so the mapped old one is not
+   changed, the order of results is changed */
+int write_locate_store(
+	char const *path, std::time_t mtime, std::size_t limit,
+	std::vector<stored_locate_t> *results
+);
+
+#endif
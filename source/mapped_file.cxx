@@ -0,0 +1,50 @@
+#include "mapped_file.hxx"
+#include "use_locate.hxx"
+
+#include <cerrno>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+int map_file(char const *path, int advice, mapped_file_t *result)
+{
+	int fd;
+	while((fd = open(path, O_RDONLY | O_CLOEXEC)) < 0){
+		int error;
+		if((error = errno) != EINTR) return nonzero_errno(error);
+	}
+	
+	struct stat statbuf;
+	if(fstat(fd, &statbuf) < 0){
+		int error = nonzero_errno(errno);
+		close(fd);
+		return error;
+	}
+	if(statbuf.st_size == 0){
+		close(fd);
+		result->data = nullptr;
+		result->size = 0;
+		return 0;
+	}
+	
+	void *data = mmap(nullptr, statbuf.st_size, PROT_READ, MAP_SHARED, fd, 0);
+	int error = (data == MAP_FAILED) ? nonzero_errno(errno) : 0;
+	close(fd); /* the mapping keeps the file */
+	if(error != 0) return error;
+	
+	madvise(data, statbuf.st_size, advice); /* only a hint */
+	result->data = static_cast<unsigned char const *>(data);
+	result->size = statbuf.st_size;
+	return 0;
+}
+
+void unmap_file(mapped_file_t *file)
+{
+	if(file->data != nullptr){
+		munmap(const_cast<unsigned char *>(file->data), file->size);
+		file->data = nullptr;
+		file->size = 0;
+	}
+}
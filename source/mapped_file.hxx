@@ -0,0 +1,14 @@
+#ifndef MAPPED_FILE_HXX
+#define MAPPED_FILE_HXX
+
+#include <cstddef>
+
+struct mapped_file_t {
+	unsigned char const *data;
+	std::size_t size;
+};
+
+int map_file(char const *path, int advice, mapped_file_t *result);
+void unmap_file(mapped_file_t *file);
+
+#endif
@@ -0,0 +1,212 @@
+#include "mlocate_db.hxx"
+#include "mapped_file.hxx"
+#include "use_locate.hxx"
+
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <string>
+
+#include <sys/mman.h>
+
+/* both formats are read sequentially from the head, so the database is
+   mapped with MADV_SEQUENTIAL and no index is used */
+
+static char const *find_nul(char const *p, char const *end)
+{
+	return static_cast<char const *>(std::memchr(p, '\0', end - p));
+}
+
+static std::uint8_t read_u8(char const *p)
+{
+	return static_cast<unsigned char>(*p);
+}
+
+static std::uint32_t read_be32(char const *p)
+{
+	return (static_cast<std::uint32_t>(read_u8(p)) << 24)
+		| (static_cast<std::uint32_t>(read_u8(p + 1)) << 16)
+		| (static_cast<std::uint32_t>(read_u8(p + 2)) << 8) | read_u8(p + 3);
+}
+
+/* returns -1 when reaching to the limit */
+static int found(
+	std::string_view path, locate_type_t type, std::size_t *count, std::size_t limit,
+	locate_callback_t f
+)
+{
+	int error = f(path, type);
+	if(error != 0) return error;
+	if(++ *count >= limit) return -1;
+	return 0;
+}
+
+/* mlocate.db layout (big endian)
+   header: "\0mlocate", uint32 size of configuration block, uint8 version (0),
+     uint8 require visibility, 2 bytes padding, root path, configuration block
+   directory: uint64 seconds, uint32 nanoseconds, 4 bytes padding, path,
+     entries of {uint8 type (0: file, 1: directory), name},
+     terminated by uint8 type (2) */
+
+static char const mlocate_magic[8] = {'\0', 'm', 'l', 'o', 'c', 'a', 't', 'e'};
+
+static std::size_t const mlocate_header_size = 16;
+static std::size_t const mlocate_directory_header_size = 16;
+
+enum mlocate_entry_type_t {mlet_file = 0, mlet_dir = 1, mlet_end = 2};
+
+static int scan_mlocate(
+	mapped_file_t const *file, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled, std::size_t *count
+)
+{
+	char const *p = reinterpret_cast<char const *>(file->data);
+	char const *end = p + file->size;
+	if(
+		file->size < mlocate_header_size || std::memcmp(p, mlocate_magic, 8) != 0
+		|| read_u8(p + 12) != 0 /* version */
+	){
+		return EUNSUPPORTED_DATABASE;
+	}
+	std::uint32_t configuration_size = read_be32(p + 8);
+	p += mlocate_header_size;
+	char const *root = find_nul(p, end);
+	if(root == nullptr) return EUNSUPPORTED_DATABASE;
+	p = root + 1;
+	if(static_cast<std::size_t>(end - p) < configuration_size){
+		return EUNSUPPORTED_DATABASE;
+	}
+	p += configuration_size;
+	
+	int error;
+	std::string path;
+	bool root_directory = true;
+	while(p < end){
+		if(cancelled()) return ECANCELED;
+		if(static_cast<std::size_t>(end - p) < mlocate_directory_header_size){
+			return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+		}
+		p += mlocate_directory_header_size;
+		char const *dir_end = find_nul(p, end);
+		if(dir_end == nullptr) return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+		std::string_view dir(p, dir_end - p);
+		p = dir_end + 1;
+		if(root_directory){
+			root_directory = false;
+			if(match_locate_pattern(dir, pattern)){
+				if((error = found(dir, lrt_directory, count, limit, f)) != 0) return error;
+			}
+		}
+		path.assign(dir);
+		if(! path.ends_with('/')) path.push_back('/');
+		std::size_t dir_length = path.size();
+		for(;;){
+			if(p >= end) return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+			std::uint8_t type = read_u8(p ++);
+			if(type == mlet_end) break;
+			if(type != mlet_file && type != mlet_dir){
+				return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+			}
+			char const *name_end = find_nul(p, end);
+			if(name_end == nullptr) return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+			std::string_view name(p, name_end - p);
+			p = name_end + 1;
+			/* the base name can be tested before concatenating */
+			if(pattern->base_name && ! match_locate_pattern(name, pattern)){
+				continue;
+			}
+			path.resize(dir_length);
+			path.append(name);
+			if(pattern->base_name || match_locate_pattern(path, pattern)){
+				locate_type_t path_type = (type == mlet_dir) ? lrt_directory : lrt_other;
+				if((error = found(path, path_type, count, limit, f)) != 0) return error;
+			}
+		}
+	}
+	return 0;
+}
+
+int mlocate_locate(
+	char const *db_path, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+)
+{
+	int error;
+	mapped_file_t file;
+	if((error = map_file(db_path, MADV_SEQUENTIAL, &file)) != 0) return error;
+	std::size_t count = 0;
+	error = scan_mlocate(&file, pattern, limit, f, cancelled, &count);
+	if(error < 0) error = 0; /* limit */
+	unmap_file(&file);
+	return error;
+}
+
+/* LOCATE02 layout
+   header: "\0LOCATE02\0"
+   entry: int8 difference of the length of the common prefix with
+     the previous path (or 0x80 and big endian int16), suffix
+   the old slocate format has a byte of the security level instead of
+   the header */
+
+static unsigned const cancel_interval = 4096; /* entries */
+
+static char const locate02_magic[10] =
+	{'\0', 'L', 'O', 'C', 'A', 'T', 'E', '0', '2', '\0'};
+
+static int scan_slocate(
+	mapped_file_t const *file, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled, std::size_t *count
+)
+{
+	char const *p = reinterpret_cast<char const *>(file->data);
+	char const *end = p + file->size;
+	if(file->size >= 10 && std::memcmp(p, locate02_magic, 10) == 0){
+		p += 10;
+	}else if(file->size >= 1 && (*p == '0' || *p == '1')){
+		p += 1;
+	}else{
+		return EUNSUPPORTED_DATABASE;
+	}
+	
+	int error;
+	std::string path;
+	long prefix_length = 0;
+	unsigned entries = 0;
+	while(p < end){
+		if(++ entries % cancel_interval == 0 && cancelled()) return ECANCELED;
+		int difference = static_cast<std::int8_t>(read_u8(p ++));
+		if(difference == -0x80){
+			if(end - p < 2) return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+			difference = static_cast<std::int16_t>((read_u8(p) << 8) | read_u8(p + 1));
+			p += 2;
+		}
+		prefix_length += difference;
+		if(prefix_length < 0 || static_cast<std::size_t>(prefix_length) > path.size()){
+			return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+		}
+		char const *suffix_end = find_nul(p, end);
+		if(suffix_end == nullptr) return (*count == 0) ? EUNSUPPORTED_DATABASE : EIO;
+		path.resize(prefix_length);
+		path.append(p, suffix_end - p);
+		p = suffix_end + 1;
+		if(match_locate_pattern(path, pattern)){
+			if((error = found(path, lrt_unknown, count, limit, f)) != 0) return error;
+		}
+	}
+	return 0;
+}
+
+int slocate_locate(
+	char const *db_path, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+)
+{
+	int error;
+	mapped_file_t file;
+	if((error = map_file(db_path, MADV_SEQUENTIAL, &file)) != 0) return error;
+	std::size_t count = 0;
+	error = scan_slocate(&file, pattern, limit, f, cancelled, &count);
+	if(error < 0) error = 0; /* limit */
+	unmap_file(&file);
+	return error;
+}
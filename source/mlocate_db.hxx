@@ -0,0 +1,23 @@
+#ifndef MLOCATE_DB_HXX
+#define MLOCATE_DB_HXX
+
+#include "locate_pattern.hxx"
+#include "use_locate.hxx"
+
+#include <cstddef>
+#include <string_view>
+
+/* reading mlocate.db directly, returns EUNSUPPORTED_DATABASE if the file is
+   not a known version of mlocate.db */
+int mlocate_locate(
+	char const *db_path, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+);
+
+/* same as above, for the databases of Findutils (LOCATE02) or slocate */
+int slocate_locate(
+	char const *db_path, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+);
+
+#endif
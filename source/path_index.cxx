@@ -0,0 +1,519 @@
+#include "path_index.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* layout (native byte order)
+   header: "KRLINDEX", uint32 byte order mark, uint32 version (1),
+     int64 mtime of the database, uint64 number of paths,
+     uint64 number of blocks, uint64 offset of blocks,
+     uint64 number of trigrams, uint64 offset of trigrams,
+     uint64 reserved, uint64 size of the file
+   paths: blocks of up to 32 entries of {varint length shared with the
+     previous path (0 for the first one in a block), varint length of the
+     rest, uint8 locate_type_t, the rest}
+   blocks: uint64 offsets of the blocks, and the end of the last one
+   trigrams: {uint32 trigram, uint32 number of blocks, uint64 offset of the
+     posting list}, sorted by trigram, and {0, 0, the end of the last list}
+   posting lists: varint differences of the block numbers */
+
+static char const index_magic[8] = {'K', 'R', 'L', 'I', 'N', 'D', 'E', 'X'};
+static std::uint32_t const index_byte_order = 0x01020304;
+static std::uint32_t const index_version = 1;
+
+static std::size_t const index_header_size = 80;
+static std::size_t const index_trigram_size = 16;
+static std::size_t const index_block_length = 32;
+
+/* all paths are listed by the substring "/" */
+static std::size_t const index_locate_limit = std::numeric_limits<std::int32_t>::max();
+
+static std::uint32_t read_u32(unsigned char const *p)
+{
+	std::uint32_t result;
+	std::memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+static std::uint64_t read_u64(unsigned char const *p)
+{
+	std::uint64_t result;
+	std::memcpy(&result, p, sizeof(result));
+	return result;
+}
+
+/* returns false if it runs over end */
+static bool read_varint(
+	unsigned char const **p, unsigned char const *end, std::uint64_t *result
+)
+{
+	std::uint64_t value = 0;
+	for(int shift = 0; shift < 64; shift += 7){
+		if(*p >= end) return false;
+		unsigned char c = *(*p) ++;
+		value |= static_cast<std::uint64_t>(c & 0x7f) << shift;
+		if((c & 0x80) == 0){
+			*result = value;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void append_varint(std::string *buffer, std::uint64_t x)
+{
+	while(x >= 0x80){
+		buffer->push_back(static_cast<char>((x & 0x7f) | 0x80));
+		x >>= 7;
+	}
+	buffer->push_back(static_cast<char>(x));
+}
+
+static unsigned char fold(unsigned char c)
+{
+	return (c >= 'A' && c <= 'Z') ? c | 0x20 : c;
+}
+
+static std::uint32_t make_trigram(unsigned char a, unsigned char b, unsigned char c)
+{
+	return (static_cast<std::uint32_t>(a) << 16) | (static_cast<std::uint32_t>(b) << 8) | c;
+}
+
+int open_path_index(char const *path, std::time_t mtime, path_index_t *result)
+{
+	mapped_file_t file;
+	int error;
+	if((error = map_file(path, MADV_RANDOM, &file)) != 0) return error;
+	
+	unsigned char const *p = file.data;
+	if(
+		file.size < index_header_size || std::memcmp(p, index_magic, 8) != 0
+		|| read_u32(p + 8) != index_byte_order || read_u32(p + 12) != index_version
+		|| read_u64(p + 72) != file.size
+	){
+		error = EUNSUPPORTED_DATABASE;
+	}else if(static_cast<std::time_t>(read_u64(p + 16)) != mtime){
+		error = ESTALE;
+	}else{
+		std::uint64_t block_count = read_u64(p + 32);
+		std::uint64_t blocks_offset = read_u64(p + 40);
+		std::uint64_t trigram_count = read_u64(p + 48);
+		std::uint64_t trigrams_offset = read_u64(p + 56);
+		if(
+			blocks_offset > file.size
+			|| (file.size - blocks_offset) / sizeof(std::uint64_t) <= block_count
+			|| trigrams_offset > file.size
+			|| (file.size - trigrams_offset) / index_trigram_size <= trigram_count
+		){
+			error = EUNSUPPORTED_DATABASE;
+		}
+	}
+	if(error != 0){
+		unmap_file(&file);
+		return error;
+	}
+	
+	result->file = file;
+	result->mtime = mtime;
+	result->block_count = read_u64(p + 32);
+	result->trigram_count = read_u64(p + 48);
+	return 0;
+}
+
+void close_path_index(path_index_t *index)
+{
+	unmap_file(&index->file);
+}
+
+/* searching */
+
+static unsigned char const *find_trigram(path_index_t const *index, std::uint32_t trigram)
+{
+	unsigned char const *trigrams = index->file.data + read_u64(index->file.data + 56);
+	std::uint64_t low = 0;
+	std::uint64_t high = index->trigram_count;
+	while(low < high){
+		std::uint64_t middle = low + (high - low) / 2;
+		unsigned char const *entry = trigrams + middle * index_trigram_size;
+		std::uint32_t x = read_u32(entry);
+		if(x < trigram){
+			low = middle + 1;
+		}else if(x > trigram){
+			high = middle;
+		}else{
+			return entry;
+		}
+	}
+	return nullptr;
+}
+
+/* returns false if the list is broken */
+static bool read_postings(
+	path_index_t const *index, unsigned char const *entry,
+	std::vector<std::uint64_t> *result
+)
+{
+	mapped_file_t const *file = &index->file;
+	std::uint64_t offset = read_u64(entry + 8);
+	std::uint64_t end_offset = read_u64(entry + index_trigram_size + 8);
+	if(offset > end_offset || end_offset > file->size) return false;
+	unsigned char const *p = file->data + offset;
+	unsigned char const *end = file->data + end_offset;
+	std::uint32_t count = read_u32(entry + 4);
+	result->clear();
+	result->reserve(count);
+	std::uint64_t block = 0;
+	for(std::uint32_t i = 0; i < count; ++ i){
+		std::uint64_t difference;
+		if(! read_varint(&p, end, &difference)) return false;
+		block += difference;
+		if(block >= index->block_count) return false;
+		result->push_back(block);
+	}
+	return true;
+}
+
+/* the trigrams that any matched path contains, false if none */
+static bool pattern_trigrams(
+	locate_pattern_t const *pattern, std::vector<std::uint32_t> *result
+)
+{
+	std::vector<std::string> fragments;
+	literal_fragments(pattern, &fragments);
+	result->clear();
+	for(
+		std::vector<std::string>::const_iterator i = fragments.cbegin();
+		i != fragments.cend();
+		++ i
+	){
+		for(std::size_t j = 0; j + 3 <= i->size(); ++ j){
+			unsigned char a = (*i)[j];
+			unsigned char b = (*i)[j + 1];
+			unsigned char c = (*i)[j + 2];
+			if(pattern->ignore_case && (a >= 0x80 || b >= 0x80 || c >= 0x80)){
+				continue; /* folding is not by byte */
+			}
+			result->push_back(make_trigram(fold(a), fold(b), fold(c)));
+		}
+	}
+	std::sort(result->begin(), result->end());
+	result->erase(std::unique(result->begin(), result->end()), result->end());
+	return ! result->empty();
+}
+
+int path_index_locate(
+	path_index_t const *index, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+)
+{
+	mapped_file_t const *file = &index->file;
+	
+	/* the candidate blocks, from the rarest trigram */
+	std::vector<std::uint64_t> candidates;
+	std::vector<std::uint32_t> trigrams;
+	bool all_blocks = ! pattern_trigrams(pattern, &trigrams);
+	if(! all_blocks){
+		std::vector<unsigned char const *> entries;
+		for(
+			std::vector<std::uint32_t>::const_iterator i = trigrams.cbegin();
+			i != trigrams.cend();
+			++ i
+		){
+			unsigned char const *entry = find_trigram(index, *i);
+			if(entry == nullptr) return 0; /* no path has this trigram */
+			entries.push_back(entry);
+		}
+		std::sort(
+			entries.begin(), entries.end(),
+			[](unsigned char const *left, unsigned char const *right){
+				return read_u32(left + 4) < read_u32(right + 4);
+			}
+		);
+		std::vector<std::uint64_t> list;
+		std::vector<std::uint64_t> intersection;
+		for(std::size_t i = 0; i < entries.size(); ++ i){
+			if(! read_postings(index, entries[i], &list)) return EUNSUPPORTED_DATABASE;
+			if(i == 0){
+				candidates.swap(list);
+			}else{
+				intersection.clear();
+				std::set_intersection(
+					candidates.cbegin(), candidates.cend(), list.cbegin(), list.cend(),
+					std::back_inserter(intersection)
+				);
+				candidates.swap(intersection);
+			}
+			if(candidates.empty()) return 0;
+		}
+	}
+	
+	/* verifying the paths in the candidate blocks */
+	unsigned char const *block_offsets = file->data + read_u64(file->data + 40);
+	std::size_t count = 0;
+	std::size_t n = all_blocks ? index->block_count : candidates.size();
+	std::string path;
+	for(std::size_t i = 0; i < n; ++ i){
+		if(cancelled()) return ECANCELED;
+		std::uint64_t block = all_blocks ? i : candidates[i];
+		std::uint64_t offset = read_u64(block_offsets + block * sizeof(std::uint64_t));
+		std::uint64_t end_offset =
+			read_u64(block_offsets + (block + 1) * sizeof(std::uint64_t));
+		if(offset > end_offset || end_offset > file->size) return EUNSUPPORTED_DATABASE;
+		unsigned char const *p = file->data + offset;
+		unsigned char const *end = file->data + end_offset;
+		path.clear();
+		while(p < end){
+			std::uint64_t shared;
+			std::uint64_t rest;
+			if(
+				! read_varint(&p, end, &shared) || ! read_varint(&p, end, &rest)
+				|| shared > path.size() || p >= end
+				|| static_cast<std::uint64_t>(end - p) - 1 < rest
+			){
+				return EUNSUPPORTED_DATABASE;
+			}
+			locate_type_t type = static_cast<locate_type_t>(*p ++);
+			if(type > lrt_directory) type = lrt_unknown;
+			path.resize(shared);
+			path.append(reinterpret_cast<char const *>(p), rest);
+			p += rest;
+			if(match_locate_pattern(path, pattern)){
+				int error = f(path, type);
+				if(error != 0) return error;
+				if(++ count >= limit) return 0;
+			}
+		}
+	}
+	return 0;
+}
+
+/* building */
+
+struct posting_builder_t {
+	std::string list;
+	std::uint64_t last_block;
+	std::uint32_t count;
+};
+
+struct index_builder_t {
+	std::string blocks;
+	std::vector<std::uint64_t> block_offsets;
+	std::string previous;
+	std::size_t in_block;
+	std::vector<std::uint32_t> block_trigrams;
+	std::unordered_map<std::uint32_t, posting_builder_t> postings;
+	std::uint64_t path_count;
+};
+
+static void finish_block(index_builder_t *builder)
+{
+	if(builder->in_block == 0) return;
+	std::uint64_t block = builder->block_offsets.size() - 1;
+	std::vector<std::uint32_t> &trigrams = builder->block_trigrams;
+	std::sort(trigrams.begin(), trigrams.end());
+	trigrams.erase(std::unique(trigrams.begin(), trigrams.end()), trigrams.end());
+	for(
+		std::vector<std::uint32_t>::const_iterator i = trigrams.cbegin();
+		i != trigrams.cend();
+		++ i
+	){
+		std::pair<std::unordered_map<std::uint32_t, posting_builder_t>::iterator, bool>
+			emplaced = builder->postings.try_emplace(*i);
+		posting_builder_t &posting = emplaced.first->second;
+		if(emplaced.second){
+			posting.last_block = 0;
+			posting.count = 0;
+		}
+		append_varint(&posting.list, block - posting.last_block);
+		posting.last_block = block;
+		++ posting.count;
+	}
+	trigrams.clear();
+	builder->in_block = 0;
+}
+
+static void add_path(index_builder_t *builder, std::string_view item, locate_type_t type)
+{
+	if(builder->in_block == index_block_length){
+		finish_block(builder);
+	}
+	std::size_t shared = 0;
+	if(builder->in_block == 0){
+		builder->block_offsets.push_back(builder->blocks.size());
+	}else{
+		std::size_t n = std::min(item.size(), builder->previous.size());
+		while(shared < n && item[shared] == builder->previous[shared]) ++ shared;
+	}
+	append_varint(&builder->blocks, shared);
+	append_varint(&builder->blocks, item.size() - shared);
+	builder->blocks.push_back(static_cast<char>(type));
+	builder->blocks.append(item.substr(shared));
+	for(std::size_t i = 0; i + 3 <= item.size(); ++ i){
+		builder->block_trigrams.push_back(
+			make_trigram(fold(item[i]), fold(item[i + 1]), fold(item[i + 2]))
+		);
+	}
+	builder->previous.assign(item);
+	++ builder->in_block;
+	++ builder->path_count;
+}
+
+static int write_all(int fd, char const *data, std::size_t size)
+{
+	while(size > 0){
+		ssize_t r = write(fd, data, size);
+		if(r < 0){
+			int error;
+			if((error = errno) != EINTR) return nonzero_errno(error);
+			continue;
+		}
+		data += r;
+		size -= r;
+	}
+	return 0;
+}
+
+static void append_u32(std::string *buffer, std::uint32_t x)
+{
+	buffer->append(reinterpret_cast<char const *>(&x), sizeof(x));
+}
+
+static void append_u64(std::string *buffer, std::uint64_t x)
+{
+	buffer->append(reinterpret_cast<char const *>(&x), sizeof(x));
+}
+
+static int write_index(int fd, index_builder_t *builder, std::time_t mtime)
+{
+	std::vector<std::uint32_t> keys;
+	keys.reserve(builder->postings.size());
+	for(
+		std::unordered_map<std::uint32_t, posting_builder_t>::const_iterator i =
+			builder->postings.cbegin();
+		i != builder->postings.cend();
+		++ i
+	){
+		keys.push_back(i->first);
+	}
+	std::sort(keys.begin(), keys.end());
+	
+	std::uint64_t blocks_offset = index_header_size + builder->blocks.size();
+	std::uint64_t trigrams_offset =
+		blocks_offset + builder->block_offsets.size() * sizeof(std::uint64_t);
+	std::uint64_t postings_offset = trigrams_offset + (keys.size() + 1) * index_trigram_size;
+	
+	std::string trigrams;
+	std::uint64_t offset = postings_offset;
+	for(
+		std::vector<std::uint32_t>::const_iterator i = keys.cbegin();
+		i != keys.cend();
+		++ i
+	){
+		posting_builder_t const &posting = builder->postings[*i];
+		append_u32(&trigrams, *i);
+		append_u32(&trigrams, posting.count);
+		append_u64(&trigrams, offset);
+		offset += posting.list.size();
+	}
+	append_u32(&trigrams, 0);
+	append_u32(&trigrams, 0);
+	append_u64(&trigrams, offset);
+	
+	std::string header;
+	header.append(index_magic, 8);
+	append_u32(&header, index_byte_order);
+	append_u32(&header, index_version);
+	append_u64(&header, static_cast<std::int64_t>(mtime));
+	append_u64(&header, builder->path_count);
+	append_u64(&header, builder->block_offsets.size() - 1);
+	append_u64(&header, blocks_offset);
+	append_u64(&header, keys.size());
+	append_u64(&header, trigrams_offset);
+	append_u64(&header, 0);
+	append_u64(&header, offset); /* the size */
+	
+	int error;
+	if(
+		(error = write_all(fd, header.data(), header.size())) != 0
+		|| (error = write_all(fd, builder->blocks.data(), builder->blocks.size())) != 0
+		|| (error =
+			write_all(
+				fd, reinterpret_cast<char const *>(builder->block_offsets.data()),
+				builder->block_offsets.size() * sizeof(std::uint64_t)
+			)) != 0
+		|| (error = write_all(fd, trigrams.data(), trigrams.size())) != 0
+	){
+		return error;
+	}
+	std::string buffer; /* the small lists are written at once */
+	for(
+		std::vector<std::uint32_t>::const_iterator i = keys.cbegin();
+		i != keys.cend();
+		++ i
+	){
+		buffer.append(builder->postings[*i].list);
+		if(buffer.size() >= 0x100000 || i + 1 == keys.cend()){
+			if((error = write_all(fd, buffer.data(), buffer.size())) != 0) return error;
+			buffer.clear();
+		}
+	}
+	return 0;
+}
+
+int build_path_index(char const *path, std::time_t mtime, locate_cancelled_t cancelled)
+{
+	index_builder_t builder;
+	builder.in_block = 0;
+	builder.path_count = 0;
+	auto f = [&builder](std::string_view item, locate_type_t type){
+		add_path(&builder, item, type);
+		return 0;
+	};
+	int status;
+	int error = locate("/", false, false, index_locate_limit, f, cancelled, &status);
+	if(error != 0) return error;
+	finish_block(&builder);
+	builder.block_offsets.push_back(builder.blocks.size());
+	for(
+		std::vector<std::uint64_t>::iterator i = builder.block_offsets.begin();
+		i != builder.block_offsets.end();
+		++ i
+	){
+		*i += index_header_size;
+	}
+	
+	/* writing to a temporary file and renaming it, as locate_store */
+	std::string temporary(path);
+	temporary.append(".");
+	temporary.append(std::to_string(getpid()));
+	int fd;
+	while(
+		(fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600))
+			< 0
+	){
+		if((error = errno) != EINTR) return nonzero_errno(error);
+	}
+	error = write_index(fd, &builder, mtime);
+	if(close(fd) < 0 && error == 0 && errno != EINTR){
+		error = nonzero_errno(errno);
+	}
+	if(error == 0 && std::rename(temporary.c_str(), path) < 0){
+		error = nonzero_errno(errno);
+	}
+	if(error != 0){
+		unlink(temporary.c_str());
+	}
+	return error;
+}
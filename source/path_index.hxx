@@ -0,0 +1,39 @@
+#ifndef PATH_INDEX_HXX
+#define PATH_INDEX_HXX
+
+#include "locate_pattern.hxx"
+#include "mapped_file.hxx"
+#include "use_locate.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <ctime>
+
+/* a private index of all paths in the database, made from the output of
+   locate once for each generation of the database:
+   the paths are front coded in blocks, and the blocks containing each
+   trigram (ASCII letters are folded) are listed */
+
+struct path_index_t {
+	mapped_file_t file;
+	std::time_t mtime; /* of the database that the index is made from */
+	std::uint64_t block_count;
+	std::uint64_t trigram_count;
+};
+
+/* returns ESTALE if it is made from the other database than mtime,
+   or EUNSUPPORTED_DATABASE if it is not a known version */
+int open_path_index(char const *path, std::time_t mtime, path_index_t *result);
+void close_path_index(path_index_t *index);
+
+/* running locate for all paths and writing the index to path */
+int build_path_index(char const *path, std::time_t mtime, locate_cancelled_t cancelled);
+
+/* same as locate_in_process(), in the order of the database,
+   only the blocks containing all trigrams of the literal parts are read */
+int path_index_locate(
+	path_index_t const *index, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+);
+
+#endif
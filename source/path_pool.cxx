@@ -0,0 +1,143 @@
+#include "path_pool.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <functional>
+#include <iterator>
+
+/* a record in a chunk is the length in 4 bytes and the path,
+   aligned to 4 bytes */
+
+static std::size_t const length_size = sizeof(std::uint32_t);
+
+static std::size_t record_size(std::size_t length)
+{
+	return (length_size + length + 3) & ~std::size_t{3};
+}
+
+path_pool_t::path_pool_t()
+{
+	for(std::size_t i = 0; i < shard_count; ++ i){
+		shard_t *s = &this->shards[i];
+		std::fill(std::begin(s->chunks), std::end(s->chunks), nullptr);
+		s->used_chunks = 0;
+		s->used_bytes = chunk_size;
+		s->table.assign(64, slot_t{0, no_path_id});
+		s->size = 0;
+	}
+}
+
+path_pool_t::~path_pool_t()
+{
+	for(std::size_t i = 0; i < shard_count; ++ i){
+		shard_t *s = &this->shards[i];
+		for(std::size_t j = 0; j < s->used_chunks; ++ j){
+			delete[] s->chunks[j];
+		}
+	}
+}
+
+path_id_t path_pool_t::append(shard_t *s, std::string_view path)
+{
+	std::size_t size = record_size(path.size());
+	if(s->used_bytes + size > chunk_size){
+		if(s->used_chunks == chunk_count) return no_path_id;
+		s->chunks[s->used_chunks] = new unsigned char[chunk_size];
+		++ s->used_chunks;
+		s->used_bytes = 0;
+	}
+	std::size_t chunk = s->used_chunks - 1;
+	std::size_t offset = s->used_bytes;
+	unsigned char *record = s->chunks[chunk] + offset;
+	std::uint32_t length = path.size();
+	std::memcpy(record, &length, length_size);
+	std::memcpy(record + length_size, path.data(), path.size());
+	s->used_bytes += size;
+	return static_cast<path_id_t>(((s - this->shards) << 28) | (chunk << 20) | offset);
+}
+
+void path_pool_t::grow(shard_t *s)
+{
+	std::vector<slot_t> table(s->table.size() * 2, slot_t{0, no_path_id});
+	std::size_t mask = table.size() - 1;
+	for(
+		std::vector<slot_t>::const_iterator i = s->table.cbegin();
+		i != s->table.cend();
+		++ i
+	){
+		if(i->id != no_path_id){
+			std::size_t j = i->hash & mask;
+			while(table[j].id != no_path_id) j = (j + 1) & mask;
+			table[j] = *i;
+		}
+	}
+	s->table.swap(table);
+}
+
+int path_pool_t::intern(std::string_view path, path_id_t *result)
+{
+	if(record_size(path.size()) > chunk_size){
+		return ENAMETOOLONG;
+	}
+	
+	std::size_t hash = std::hash<std::string_view>()(path);
+	shard_t *s = &this->shards[shard_index(hash)];
+	std::uint32_t short_hash = static_cast<std::uint32_t>(hash >> 32 ^ hash);
+	std::lock_guard<std::mutex> lock(s->mutex);
+	std::size_t mask = s->table.size() - 1;
+	std::size_t i = short_hash & mask;
+	while(s->table[i].id != no_path_id){
+		if(s->table[i].hash == short_hash && this->get(s->table[i].id) == path){
+			*result = s->table[i].id;
+			return 0;
+		}
+		i = (i + 1) & mask;
+	}
+	
+	path_id_t id = this->append(s, path);
+	if(id == no_path_id){
+		return ENOMEM;
+	}
+	s->table[i] = slot_t{short_hash, id};
+	++ s->size;
+	if(s->size * 2 > s->table.size()){
+		this->grow(s);
+	}
+	*result = id;
+	return 0;
+}
+
+std::string_view path_pool_t::get(path_id_t id) const
+{
+	shard_t const *s = &this->shards[id >> 28];
+	unsigned char const *record = s->chunks[(id >> 20) & (chunk_count - 1)]
+		+ (id & (chunk_size - 1));
+	std::uint32_t length;
+	std::memcpy(&length, record, length_size);
+	return std::string_view(
+		reinterpret_cast<char const *>(record + length_size), length
+	);
+}
+
+std::size_t path_pool_t::size() const
+{
+	std::size_t result = 0;
+	for(std::size_t i = 0; i < shard_count; ++ i){
+		shard_t const *s = &this->shards[i];
+		std::lock_guard<std::mutex> lock(s->mutex);
+		result += s->size;
+	}
+	return result;
+}
+
+std::size_t path_pool_t::memory_size() const
+{
+	std::size_t result = sizeof(path_pool_t);
+	for(std::size_t i = 0; i < shard_count; ++ i){
+		shard_t const *s = &this->shards[i];
+		std::lock_guard<std::mutex> lock(s->mutex);
+		result += s->used_chunks * chunk_size + s->table.capacity() * sizeof(slot_t);
+	}
+	return result;
+}
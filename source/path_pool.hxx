@@ -0,0 +1,60 @@
+#ifndef PATH_POOL_HXX
+#define PATH_POOL_HXX
+
+#include "sharded_map.hxx"
+
+#include <cstddef>
+#include <cstdint>
+#include <mutex>
+#include <string_view>
+#include <vector>
+
+/* an ID of a path interned in path_pool_t,
+   [shard:4][chunk:8][offset in the chunk:20] */
+typedef std::uint32_t path_id_t;
+
+inline constexpr path_id_t no_path_id = 0xffffffffu;
+
+/* append-only storage of unique paths, freed all at once,
+   the paths never move so get() does not lock */
+
+class path_pool_t {
+	static constexpr std::size_t chunk_size = std::size_t{1} << 20;
+	static constexpr std::size_t chunk_count = 256;
+	
+	struct slot_t {
+		std::uint32_t hash;
+		path_id_t id; /* no_path_id if empty */
+	};
+	
+	struct shard_t {
+		mutable std::mutex mutex;
+		unsigned char *chunks[chunk_count];
+		std::size_t used_chunks;
+		std::size_t used_bytes; /* in the last chunk */
+		std::vector<slot_t> table; /* open addressing, the size is power of 2 */
+		std::size_t size;
+	};
+	
+	shard_t shards[shard_count];
+	
+	path_id_t append(shard_t *s, std::string_view path);
+	void grow(shard_t *s);
+	
+public:
+	path_pool_t();
+	path_pool_t(path_pool_t const &) = delete;
+	~path_pool_t();
+	
+	path_pool_t &operator = (path_pool_t const &) = delete;
+	
+	/* returns ENAMETOOLONG or ENOMEM if it can not be stored */
+	int intern(std::string_view path, path_id_t *result);
+	
+	std::string_view get(path_id_t id) const;
+	
+	std::size_t size() const;
+	std::size_t memory_size() const;
+};
+
+#endif
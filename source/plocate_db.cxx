@@ -0,0 +1,769 @@
+#include "plocate_db.hxx"
+#include "mapped_file.hxx"
+#include "use_locate.hxx"
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <iterator>
+#include <string>
+#include <vector>
+
+#include <sys/mman.h>
+
+#ifdef HAVE_ZSTD
+#include <zstd.h>
+
+/* plocate.db layout (little endian, as written by plocate-build/updatedb)
+   header: see the offsets below
+   hash table: (hashtable_size + extra_ht_slots + 1) trigram entries of
+     {uint32 trigram, uint32 num_docids, uint64 offset}
+   posting lists: TurboPFor "p4nd1" (delta minus one) in blocks of 128
+   filename index: (num_docids + 1) uint64 offsets of zstd frames,
+     each frame holds a block of NUL terminated paths */
+
+static char const plocate_magic[8] = {'\0', 'p', 'l', 'o', 'c', 'a', 't', 'e'};
+
+static std::size_t const header_version = 8;
+static std::size_t const header_hashtable_size = 12;
+static std::size_t const header_extra_ht_slots = 16;
+static std::size_t const header_num_docids = 20;
+static std::size_t const header_hash_table_offset = 24;
+static std::size_t const header_filename_index_offset = 32;
+static std::size_t const header_zstd_dictionary_length = 44;
+static std::size_t const header_zstd_dictionary_offset = 48;
+static std::size_t const header_v0_size = 40;
+static std::size_t const header_v1_size = 56;
+
+static std::size_t const trigram_entry_size = 16;
+
+template<class T>
+static T read_le(unsigned char const *p)
+{
+	T result = 0;
+	for(std::size_t i = 0; i < sizeof(T); ++ i){
+		result |= static_cast<T>(p[i]) << (i * 8);
+	}
+	return result;
+}
+
+struct plocate_t {
+	mapped_file_t file;
+	std::uint32_t hashtable_size;
+	std::uint32_t extra_ht_slots;
+	std::uint32_t num_docids;
+	unsigned char const *hash_table;
+	unsigned char const *filename_index;
+	bool use_trigrams;
+	ZSTD_DCtx *dctx;
+	ZSTD_DDict *ddict;
+};
+
+static bool in_range(plocate_t const *db, std::uint64_t offset, std::uint64_t length)
+{
+	return offset <= db->file.size && length <= db->file.size - offset;
+}
+
+static std::uint32_t hash_trigram(std::uint32_t trigram, std::uint32_t size)
+{
+	/* CRC-like */
+	std::uint32_t crc = trigram;
+	for(int i = 0; i < 32; ++ i){
+		bool bit = (crc & 0x80000000) != 0;
+		crc <<= 1;
+		if(bit) crc ^= 0x1edc6f41;
+	}
+	return crc % size;
+}
+
+static unsigned char const *trigram_entry(plocate_t const *db, std::uint32_t index)
+{
+	return db->hash_table + static_cast<std::size_t>(index) * trigram_entry_size;
+}
+
+/* the hash function is not written in the file,
+   so check that the stored entries are placed where it says */
+static bool check_hash_table(plocate_t const *db)
+{
+	std::uint32_t total = db->hashtable_size + db->extra_ht_slots;
+	int checked = 0;
+	for(std::uint32_t i = 0; i < total && checked < 64; ++ i){
+		unsigned char const *entry = trigram_entry(db, i);
+		if(read_le<std::uint32_t>(entry + 4) != 0){
+			std::uint32_t h = hash_trigram(read_le<std::uint32_t>(entry), db->hashtable_size);
+			if(i < h || i > h + db->extra_ht_slots) return false;
+			++ checked;
+		}
+	}
+	return true;
+}
+
+static int open_plocate(char const *db_path, plocate_t *db)
+{
+	int error;
+	if((error = map_file(db_path, MADV_RANDOM, &db->file)) != 0) return error;
+	
+	unsigned char const *data = db->file.data;
+	std::size_t size = db->file.size;
+	if(size < header_v0_size || std::memcmp(data, plocate_magic, 8) != 0){
+		unmap_file(&db->file);
+		return EUNSUPPORTED_DATABASE;
+	}
+	std::uint32_t version = read_le<std::uint32_t>(data + header_version);
+	if(version > 2 || (version >= 1 && size < header_v1_size)){
+		unmap_file(&db->file);
+		return EUNSUPPORTED_DATABASE;
+	}
+	
+	db->hashtable_size = read_le<std::uint32_t>(data + header_hashtable_size);
+	db->extra_ht_slots = read_le<std::uint32_t>(data + header_extra_ht_slots);
+	db->num_docids = read_le<std::uint32_t>(data + header_num_docids);
+	std::uint64_t hash_table_offset =
+		read_le<std::uint64_t>(data + header_hash_table_offset);
+	std::uint64_t filename_index_offset =
+		read_le<std::uint64_t>(data + header_filename_index_offset);
+	std::uint64_t ht_entries =
+		static_cast<std::uint64_t>(db->hashtable_size) + db->extra_ht_slots + 1;
+	if(
+		db->hashtable_size == 0
+		|| ! in_range(db, hash_table_offset, ht_entries * trigram_entry_size)
+		|| ! in_range(
+			db, filename_index_offset, (static_cast<std::uint64_t>(db->num_docids) + 1) * 8
+		)
+	){
+		unmap_file(&db->file);
+		return EUNSUPPORTED_DATABASE;
+	}
+	db->hash_table = data + hash_table_offset;
+	db->filename_index = data + filename_index_offset;
+	db->use_trigrams = check_hash_table(db);
+	
+	db->dctx = ZSTD_createDCtx();
+	if(db->dctx == nullptr){
+		unmap_file(&db->file);
+		return ENOMEM;
+	}
+	db->ddict = nullptr;
+	if(version >= 1){
+		std::uint32_t dictionary_length =
+			read_le<std::uint32_t>(data + header_zstd_dictionary_length);
+		std::uint64_t dictionary_offset =
+			read_le<std::uint64_t>(data + header_zstd_dictionary_offset);
+		if(dictionary_length > 0){
+			if(! in_range(db, dictionary_offset, dictionary_length)){
+				ZSTD_freeDCtx(db->dctx);
+				unmap_file(&db->file);
+				return EUNSUPPORTED_DATABASE;
+			}
+			db->ddict = ZSTD_createDDict(data + dictionary_offset, dictionary_length);
+			if(db->ddict == nullptr){
+				ZSTD_freeDCtx(db->dctx);
+				unmap_file(&db->file);
+				return ENOMEM;
+			}
+		}
+	}
+	return 0;
+}
+
+static void close_plocate(plocate_t *db)
+{
+	ZSTD_freeDDict(db->ddict);
+	ZSTD_freeDCtx(db->dctx);
+	unmap_file(&db->file);
+}
+
+/* posting lists */
+
+static std::size_t const block_size = 128;
+
+static std::uint32_t mask_for_bits(unsigned bit_width)
+{
+	return (bit_width >= 32) ? 0xffffffffU : (1U << bit_width) - 1;
+}
+
+static std::size_t bytes_for_packed_bits(std::size_t n, unsigned bit_width)
+{
+	return (n * bit_width + 7) / 8;
+}
+
+/* reading consecutive values of bit_width bits, from the least significant */
+struct bit_reader_t {
+	unsigned char const *p;
+	unsigned bit_width;
+	unsigned bit_position;
+	
+	std::uint32_t read()
+	{
+		std::uint64_t v = 0;
+		unsigned bytes = (this->bit_position + this->bit_width + 7) / 8;
+		for(unsigned i = 0; i < bytes; ++ i){
+			v |= static_cast<std::uint64_t>(this->p[i]) << (i * 8);
+		}
+		std::uint32_t result =
+			static_cast<std::uint32_t>(v >> this->bit_position)
+				& mask_for_bits(this->bit_width);
+		this->bit_position += this->bit_width;
+		this->p += this->bit_position / 8;
+		this->bit_position %= 8;
+		return result;
+	}
+};
+
+/* full blocks are packed in 4 interleaved 32-bit streams (for SIMD) */
+static void read_interleaved(
+	unsigned char const *in, unsigned bit_width, std::uint32_t *out
+)
+{
+	if(bit_width == 0){
+		std::fill(out, out + block_size, 0);
+		return;
+	}
+	for(unsigned lane = 0; lane < 4; ++ lane){
+		unsigned char const *words = in + lane * 4;
+		for(unsigned j = 0; j < block_size / 4; ++ j){
+			unsigned bit = j * bit_width;
+			unsigned word = bit / 32;
+			unsigned shift = bit % 32;
+			std::uint64_t v = read_le<std::uint32_t>(words + word * 16);
+			if(shift + bit_width > 32){
+				v |= static_cast<std::uint64_t>(read_le<std::uint32_t>(words + (word + 1) * 16))
+					<< 32;
+			}
+			out[j * 4 + lane] = static_cast<std::uint32_t>(v >> shift) & mask_for_bits(bit_width);
+		}
+	}
+}
+
+static unsigned char const *read_packed(
+	unsigned char const *in, unsigned char const *end, std::size_t n, unsigned bit_width,
+	bool interleaved, std::uint32_t *out
+)
+{
+	std::size_t length = bytes_for_packed_bits(n, bit_width);
+	if(static_cast<std::size_t>(end - in) < length) return nullptr;
+	if(interleaved){
+		read_interleaved(in, bit_width, out);
+	}else{
+		bit_reader_t reader{in, bit_width, 0};
+		for(std::size_t i = 0; i < n; ++ i){
+			out[i] = (bit_width == 0) ? 0 : reader.read();
+		}
+	}
+	return in + length;
+}
+
+static unsigned char const *read_baseval(
+	unsigned char const *in, unsigned char const *end, std::uint32_t *out
+)
+{
+	if(in >= end) return nullptr;
+	if(in[0] < 0x80){
+		*out = in[0];
+		return in + 1;
+	}else if(in[0] < 0xc0){
+		if(end - in < 2) return nullptr;
+		*out = ((static_cast<std::uint32_t>(in[0]) << 8) | in[1]) & 0x3fff;
+		return in + 2;
+	}else if(in[0] < 0xe0){
+		if(end - in < 3) return nullptr;
+		*out =
+			((static_cast<std::uint32_t>(in[0]) << 16)
+				| (static_cast<std::uint32_t>(in[2]) << 8) | in[1]) & 0x1fffff;
+		return in + 3;
+	}else if(in[0] < 0xf0){
+		if(end - in < 4) return nullptr;
+		*out =
+			((static_cast<std::uint32_t>(in[0]) << 24)
+				| (static_cast<std::uint32_t>(in[3]) << 16)
+				| (static_cast<std::uint32_t>(in[2]) << 8) | in[1]) & 0xfffffff;
+		return in + 4;
+	}else{
+		return nullptr;
+	}
+}
+
+static unsigned char const *read_vb(
+	unsigned char const *in, unsigned char const *end, std::uint32_t *out
+)
+{
+	if(in >= end) return nullptr;
+	if(in[0] <= 176){
+		*out = in[0];
+		return in + 1;
+	}else if(in[0] <= 240){
+		if(end - in < 2) return nullptr;
+		*out = ((static_cast<std::uint32_t>(in[0] - 177) << 8) | in[1]) + 177;
+		return in + 2;
+	}else if(in[0] <= 248){
+		if(end - in < 3) return nullptr;
+		*out =
+			((static_cast<std::uint32_t>(in[0] - 241) << 16) | read_le<std::uint16_t>(in + 1))
+				+ 16561;
+		return in + 3;
+	}else if(in[0] == 249){
+		if(end - in < 4) return nullptr;
+		*out =
+			in[1] | (static_cast<std::uint32_t>(in[2]) << 8)
+				| (static_cast<std::uint32_t>(in[3]) << 16);
+		return in + 4;
+	}else if(in[0] == 250){
+		if(end - in < 5) return nullptr;
+		*out = read_le<std::uint32_t>(in + 1);
+		return in + 5;
+	}else{
+		return nullptr;
+	}
+}
+
+enum block_type_t {bt_for = 0, bt_pfor_vb = 1, bt_pfor_bitmap = 2, bt_constant = 3};
+
+/* returns false if the data is not consistent */
+static bool decode_posting_list(
+	unsigned char const *in, std::size_t length, std::uint32_t num,
+	std::uint32_t num_docids, std::vector<std::uint32_t> *result
+)
+{
+	unsigned char const *end = in + length;
+	result->clear();
+	if(num == 0) return length == 0;
+	
+	std::uint32_t prev;
+	if((in = read_baseval(in, end, &prev)) == nullptr) return false;
+	result->push_back(prev);
+	
+	std::uint32_t values[block_size];
+	for(std::uint32_t i = 1; i < num; i += block_size){
+		std::size_t n = std::min<std::size_t>(num - i, block_size);
+		bool interleaved = n == block_size;
+		if(in >= end) return false;
+		unsigned type = in[0] >> 6;
+		unsigned bit_width = in[0] & 0x3f;
+		++ in;
+		if(bit_width > 32) return false;
+		switch(type){
+		case bt_constant:
+			{
+				std::size_t bytes = (bit_width + 7) / 8;
+				if(static_cast<std::size_t>(end - in) < bytes) return false;
+				std::uint32_t v = 0;
+				for(std::size_t j = 0; j < bytes; ++ j){
+					v |= static_cast<std::uint32_t>(in[j]) << (j * 8);
+				}
+				v &= mask_for_bits(bit_width);
+				std::fill(values, values + n, v);
+				in += bytes;
+			}
+			break;
+		case bt_for:
+			if((in = read_packed(in, end, n, bit_width, interleaved, values)) == nullptr){
+				return false;
+			}
+			break;
+		case bt_pfor_vb:
+			{
+				if(in >= end) return false;
+				unsigned num_exceptions = *in ++;
+				if(num_exceptions > n) return false;
+				if((in = read_packed(in, end, n, bit_width, interleaved, values)) == nullptr){
+					return false;
+				}
+				std::uint32_t exceptions[block_size];
+				for(unsigned j = 0; j < num_exceptions; ++ j){
+					if(bit_width == 32){
+						if(end - in < 4) return false;
+						exceptions[j] = read_le<std::uint32_t>(in);
+						in += 4;
+					}else if((in = read_vb(in, end, &exceptions[j])) == nullptr){
+						return false;
+					}
+				}
+				if(static_cast<std::size_t>(end - in) < num_exceptions) return false;
+				for(unsigned j = 0; j < num_exceptions; ++ j){
+					unsigned index = *in ++;
+					if(index >= n || bit_width >= 32) return false;
+					values[index] |= exceptions[j] << bit_width;
+				}
+			}
+			break;
+		case bt_pfor_bitmap:
+			{
+				if(in >= end) return false;
+				unsigned exception_bit_width = *in ++;
+				if(exception_bit_width > 32 || bit_width + exception_bit_width > 32){
+					return false;
+				}
+				std::size_t bitmap_length = (n + 7) / 8;
+				if(static_cast<std::size_t>(end - in) < bitmap_length) return false;
+				unsigned char const *bitmap = in;
+				in += bitmap_length;
+				std::uint32_t high[block_size];
+				std::size_t num_exceptions = 0;
+				bit_reader_t reader{in, exception_bit_width, 0};
+				for(std::size_t j = 0; j < n; ++ j){
+					high[j] = 0;
+					if((bitmap[j / 8] >> (j % 8)) & 1){
+						++ num_exceptions;
+						if(
+							bytes_for_packed_bits(num_exceptions, exception_bit_width)
+								> static_cast<std::size_t>(end - in)
+						){
+							return false;
+						}
+						if(exception_bit_width > 0) high[j] = reader.read();
+					}
+				}
+				in += bytes_for_packed_bits(num_exceptions, exception_bit_width);
+				if((in = read_packed(in, end, n, bit_width, interleaved, values)) == nullptr){
+					return false;
+				}
+				for(std::size_t j = 0; j < n; ++ j){
+					values[j] |= high[j] << bit_width;
+				}
+			}
+			break;
+		}
+		for(std::size_t j = 0; j < n; ++ j){
+			std::uint64_t next = static_cast<std::uint64_t>(prev) + values[j] + 1;
+			if(next >= num_docids) return false;
+			prev = static_cast<std::uint32_t>(next);
+			result->push_back(prev);
+		}
+	}
+	return in == end && result->back() < num_docids;
+}
+
+static std::uint32_t make_trigram(unsigned char a, unsigned char b, unsigned char c)
+{
+	return a | (static_cast<std::uint32_t>(b) << 8) | (static_cast<std::uint32_t>(c) << 16);
+}
+
+static unsigned char const *find_trigram(plocate_t const *db, std::uint32_t trigram)
+{
+	std::uint32_t h = hash_trigram(trigram, db->hashtable_size);
+	for(std::uint32_t i = 0; i <= db->extra_ht_slots; ++ i){
+		unsigned char const *entry = trigram_entry(db, h + i);
+		if(read_le<std::uint32_t>(entry) == trigram && read_le<std::uint32_t>(entry + 4) != 0){
+			return entry;
+		}
+	}
+	return nullptr;
+}
+
+/* a trigram of the pattern, and its variants of the letter case */
+struct trigram_group_t {
+	std::vector<std::uint32_t> variants;
+	std::vector<std::string> texts;
+	std::uint64_t total;
+};
+
+static bool is_ascii_letter(unsigned char c)
+{
+	return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z');
+}
+
+static void trigram_groups(
+	locate_pattern_t const *pattern, std::vector<trigram_group_t> *result
+)
+{
+	std::vector<std::string> fragments;
+	literal_fragments(pattern, &fragments);
+	std::vector<std::string> seen;
+	for(
+		std::vector<std::string>::const_iterator i = fragments.cbegin();
+		i != fragments.cend();
+		++ i
+	){
+		for(std::size_t j = 0; j + 3 <= i->size(); ++ j){
+			std::string text = i->substr(j, 3);
+			bool skip = false;
+			if(pattern->ignore_case){
+				for(int k = 0; k < 3; ++ k){
+					unsigned char c = text[k];
+					if(c >= 0x80){
+						skip = true; /* folding is not by byte */
+					}else if(is_ascii_letter(c)){
+						text[k] = c | 0x20;
+					}
+				}
+			}
+			if(skip || std::find(seen.cbegin(), seen.cend(), text) != seen.cend()){
+				continue;
+			}
+			seen.push_back(text);
+			trigram_group_t group;
+			int cases = 1;
+			if(pattern->ignore_case){
+				for(int k = 0; k < 3; ++ k){
+					if(is_ascii_letter(text[k])) cases *= 2;
+				}
+			}
+			for(int m = 0; m < cases; ++ m){
+				std::string variant = text;
+				int bit = 0;
+				for(int k = 0; k < 3; ++ k){
+					if(pattern->ignore_case && is_ascii_letter(variant[k])){
+						if((m >> bit) & 1) variant[k] &= ~0x20;
+						++ bit;
+					}
+				}
+				group.variants.push_back(
+					make_trigram(variant[0], variant[1], variant[2])
+				);
+				group.texts.push_back(std::move(variant));
+			}
+			group.total = 0;
+			result->push_back(std::move(group));
+		}
+	}
+}
+
+/* returns false if the posting lists are not consistent */
+static bool candidates_by_trigrams(
+	plocate_t const *db, std::vector<trigram_group_t> *groups,
+	std::vector<std::uint32_t> *result
+)
+{
+	std::vector<std::vector<unsigned char const *>> entries(groups->size());
+	for(std::size_t i = 0; i < groups->size(); ++ i){
+		trigram_group_t &group = (*groups)[i];
+		for(
+			std::vector<std::uint32_t>::const_iterator j = group.variants.cbegin();
+			j != group.variants.cend();
+			++ j
+		){
+			unsigned char const *entry = find_trigram(db, *j);
+			if(entry != nullptr){
+				entries[i].push_back(entry);
+				group.total += read_le<std::uint32_t>(entry + 4);
+			}
+		}
+		if(group.total == 0){
+			result->clear(); /* no path has this trigram */
+			return true;
+		}
+	}
+	
+	/* from the rarest */
+	std::vector<std::size_t> order(groups->size());
+	for(std::size_t i = 0; i < order.size(); ++ i) order[i] = i;
+	std::sort(
+		order.begin(), order.end(),
+		[groups](std::size_t left, std::size_t right){
+			return (*groups)[left].total < (*groups)[right].total;
+		}
+	);
+	
+	std::vector<std::uint32_t> list;
+	std::vector<std::uint32_t> group_list;
+	std::vector<std::uint32_t> merged;
+	for(std::size_t i = 0; i < order.size(); ++ i){
+		group_list.clear();
+		std::vector<unsigned char const *> const &group_entries = entries[order[i]];
+		for(
+			std::vector<unsigned char const *>::const_iterator j = group_entries.cbegin();
+			j != group_entries.cend();
+			++ j
+		){
+			unsigned char const *entry = *j;
+			std::uint32_t num = read_le<std::uint32_t>(entry + 4);
+			std::uint64_t offset = read_le<std::uint64_t>(entry + 8);
+			std::uint64_t next_offset = read_le<std::uint64_t>(entry + trigram_entry_size + 8);
+			if(next_offset < offset || ! in_range(db, offset, next_offset - offset)){
+				return false;
+			}
+			if(
+				! decode_posting_list(
+					db->file.data + offset, next_offset - offset, num, db->num_docids, &list
+				)
+			){
+				return false;
+			}
+			merged.clear();
+			std::set_union(
+				group_list.cbegin(), group_list.cend(), list.cbegin(), list.cend(),
+				std::back_inserter(merged)
+			);
+			group_list.swap(merged);
+		}
+		if(i == 0){
+			result->swap(group_list);
+		}else{
+			merged.clear();
+			std::set_intersection(
+				result->cbegin(), result->cend(), group_list.cbegin(), group_list.cend(),
+				std::back_inserter(merged)
+			);
+			result->swap(merged);
+		}
+		if(result->empty()) break;
+	}
+	return true;
+}
+
+static int decompress_block(
+	plocate_t *db, std::uint32_t docid, std::vector<char> *buffer
+)
+{
+	unsigned char const *index = db->filename_index + static_cast<std::size_t>(docid) * 8;
+	std::uint64_t offset = read_le<std::uint64_t>(index);
+	std::uint64_t next_offset = read_le<std::uint64_t>(index + 8);
+	if(next_offset < offset || ! in_range(db, offset, next_offset - offset)){
+		return EUNSUPPORTED_DATABASE;
+	}
+	unsigned char const *src = db->file.data + offset;
+	std::size_t src_length = next_offset - offset;
+	unsigned long long content_size = ZSTD_getFrameContentSize(src, src_length);
+	if(
+		content_size == ZSTD_CONTENTSIZE_UNKNOWN || content_size == ZSTD_CONTENTSIZE_ERROR
+	){
+		return EUNSUPPORTED_DATABASE;
+	}
+	buffer->resize(content_size);
+	std::size_t r;
+	if(db->ddict != nullptr){
+		r = ZSTD_decompress_usingDDict(
+			db->dctx, buffer->data(), buffer->size(), src, src_length, db->ddict
+		);
+	}else{
+		r = ZSTD_decompressDCtx(db->dctx, buffer->data(), buffer->size(), src, src_length);
+	}
+	if(ZSTD_isError(r) || r != content_size){
+		return EUNSUPPORTED_DATABASE;
+	}
+	if(! buffer->empty() && buffer->back() != '\0'){
+		return EUNSUPPORTED_DATABASE;
+	}
+	return 0;
+}
+
+static bool block_has_trigrams(
+	std::vector<char> const &block, std::vector<trigram_group_t> const &groups
+)
+{
+	std::string_view data(block.data(), block.size());
+	for(
+		std::vector<trigram_group_t>::const_iterator i = groups.cbegin();
+		i != groups.cend();
+		++ i
+	){
+		bool found = false;
+		for(
+			std::vector<std::string>::const_iterator j = i->texts.cbegin();
+			j != i->texts.cend();
+			++ j
+		){
+			if(data.find(*j) != std::string_view::npos){
+				found = true;
+				break;
+			}
+		}
+		if(! found) return false;
+	}
+	return true;
+}
+
+struct scan_state_t {
+	std::size_t count;
+	std::size_t limit;
+	locate_callback_t f;
+	locate_cancelled_t cancelled;
+};
+
+/* returns -1 when reaching to the limit */
+static int scan_block(
+	std::vector<char> const &block, locate_pattern_t const *pattern,
+	scan_state_t *state
+)
+{
+	char const *p = block.data();
+	char const *end = p + block.size();
+	while(p < end){
+		char const *e = static_cast<char const *>(std::memchr(p, '\0', end - p));
+		std::string_view path(p, e - p);
+		if(match_locate_pattern(path, pattern)){
+			int error = state->f(path);
+			if(error != 0) return error;
+			if(++ state->count >= state->limit) return -1;
+		}
+		p = e + 1;
+	}
+	return 0;
+}
+
+int plocate_locate(
+	char const *db_path, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+)
+{
+	int error;
+	plocate_t db;
+	if((error = open_plocate(db_path, &db)) != 0) return error;
+	
+	std::vector<trigram_group_t> groups;
+	if(db.use_trigrams){
+		trigram_groups(pattern, &groups);
+	}
+	
+	std::vector<std::uint32_t> candidates;
+	bool full_scan = groups.empty();
+	if(! full_scan && ! candidates_by_trigrams(&db, &groups, &candidates)){
+		full_scan = true; /* unknown encoding */
+	}
+	
+	scan_state_t state{0, limit, f, cancelled};
+	std::vector<char> block;
+	std::vector<std::uint32_t>::const_iterator done = candidates.cbegin();
+	error = 0;
+	if(! full_scan){
+		for(; done != candidates.cend(); ++ done){
+			if(cancelled()){
+				error = ECANCELED;
+				break;
+			}
+			if((error = decompress_block(&db, *done, &block)) != 0) break;
+			if(! block_has_trigrams(block, groups)){
+				full_scan = true; /* the posting lists were misread */
+				break;
+			}
+			if((error = scan_block(block, pattern, &state)) != 0) break;
+		}
+	}
+	if(error == 0 && full_scan){
+		/* skipping the blocks already scanned */
+		std::vector<std::uint32_t>::const_iterator skip = candidates.cbegin();
+		for(std::uint32_t docid = 0; docid < db.num_docids; ++ docid){
+			if(skip != done && *skip == docid){
+				++ skip;
+				continue;
+			}
+			if(cancelled()){
+				error = ECANCELED;
+				break;
+			}
+			if((error = decompress_block(&db, docid, &block)) != 0) break;
+			if((error = scan_block(block, pattern, &state)) != 0) break;
+		}
+	}
+	if(error < 0) error = 0; /* limit */
+	if(error == EUNSUPPORTED_DATABASE && state.count > 0){
+		error = EIO; /* could not be retried */
+	}
+	
+	close_plocate(&db);
+	return error;
+}
+
+#else
+
+int plocate_locate(
+	char const * /* db_path */, locate_pattern_t const * /* pattern */,
+	std::size_t /* limit */, locate_callback_t /* f */,
+	locate_cancelled_t /* cancelled */
+)
+{
+	return EUNSUPPORTED_DATABASE; /* built without zstd */
+}
+
+#endif
@@ -0,0 +1,17 @@
+#ifndef PLOCATE_DB_HXX
+#define PLOCATE_DB_HXX
+
+#include "locate_pattern.hxx"
+#include "use_locate.hxx"
+
+#include <cstddef>
+#include <string_view>
+
+/* reading plocate.db directly, returns EUNSUPPORTED_DATABASE if the file is
+   not a known version of plocate.db */
+int plocate_locate(
+	char const *db_path, locate_pattern_t const *pattern, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+);
+
+#endif
@@ -1,11 +1,14 @@
 #include "query.hxx"
+#include "work_pool.hxx"
 
+#include <algorithm>
 #include <cassert>
 #include <cerrno>
 #include <cstring>
+#include <functional>
+#include <vector>
 
 #include <alloca.h>
-#include <fnmatch.h>
 #include <sys/stat.h>
 
 std::string_view image(file_type_filter_t x)
@@ -23,6 +26,19 @@ std::string_view image(file_type_filter_t x)
 	}
 }
 
+std::size_t locate_query_hash_t::operator () (locate_query_t const &x) const
+{
+	std::size_t result = std::hash<std::string>()(x.pattern);
+	return (result << 2) ^ (x.base_name ? 1 : 0) ^ (x.ignore_case ? 2 : 0);
+}
+
+std::size_t query_hash_t::operator () (query_t const &x) const
+{
+	std::size_t result = locate_query_hash_t()(x.locate_query);
+	return (result * 31) ^ (x.absolute ? 1 : 0)
+		^ (static_cast<std::size_t>(x.file_type_filter) << 1);
+}
+
 static bool has_uppercase(std::string_view pattern);
 
 void parse_query(std::string_view pattern, query_t *result)
@@ -55,110 +71,132 @@ void parse_query(std::string_view pattern, query_t *result)
 		
 		result->locate_query.pattern.assign(begin, end);
 	}
+	
+	compile_pattern(
+		result->locate_query.pattern, result->locate_query.ignore_case,
+		&result->matcher
+	);
 }
 
-static bool do_fnmatch(
-	std::size_t c_pattern_length,
-	char *c_pattern, /* required c_pattern_length + 2 */
-	char const *c_item, bool ignore_case, bool at_end
-)
+static file_kind_t stat_item(std::string_view item)
 {
-	if(c_pattern_length == 0){
-		return false;
-	}
-	
-	c_pattern[c_pattern_length] = '\0';
+	std::size_t item_length = item.size();
+	char *c_item = static_cast<char *>(alloca(item_length + 1));
+	std::memcpy(c_item, item.data(), item_length);
+	c_item[item_length] = '\0';
 	
-	int flags = FNM_PATHNAME;
-	if(ignore_case) flags |= FNM_CASEFOLD;
-	if(fnmatch(c_pattern, c_item, flags) == 0){
-		return true;
+	struct stat statbuf;
+	while(lstat(c_item, &statbuf) < 0){
+		if(errno != EINTR) return fk_none;
 	}
-	if(! at_end && c_pattern[c_pattern_length - 1] != '*'){
-		c_pattern[c_pattern_length] = '*';
-		c_pattern[c_pattern_length + 1] = '\0';
-		return fnmatch(c_pattern, c_item, flags) == 0;
+	switch(statbuf.st_mode & S_IFMT){
+	case S_IFREG:
+		return fk_file;
+	case S_IFDIR:
+		return fk_directory;
+	default:
+		return fk_none;
 	}
-	return false;
 }
 
-static bool filter_by_stat(char const *c_item, bool only_dir)
+static bool filter_by_kind(file_kind_t kind, bool only_dir)
 {
-	struct stat statbuf;
-	while(lstat(c_item, &statbuf) < 0){
-		if(errno != EINTR) return false;
-	}
-	mode_t type = statbuf.st_mode & S_IFMT;
-	if(only_dir && type != S_IFDIR){
+	if(only_dir && kind != fk_directory){
 		return false;
 	}
-	return type == S_IFREG || type == S_IFDIR;
+	return kind != fk_none;
 }
 
-bool filter_query(std::string_view item, query_t const *query)
+static bool filter_by_stat(std::string_view item, bool only_dir, bool *directory)
+{
+	file_kind_t kind = stat_item(item);
+	*directory = kind == fk_directory;
+	return filter_by_kind(kind, only_dir);
+}
+
+bool match_query(std::string_view item, query_t const *query)
 {
-	std::size_t item_length = item.size();
-	char *c_item = static_cast<char *>(alloca(item_length + 1));
-	std::memcpy(c_item, item.data(), item_length);
-	c_item[item_length] = '\0';
-	
-	std::size_t pattern_length = query->locate_query.pattern.size();
-	char *c_pattern = static_cast<char *>(alloca(pattern_length + 2));
-	std::memcpy(c_pattern, query->locate_query.pattern.data(), pattern_length);
-	
 	bool only_dir = query->file_type_filter == ftf_only_dir;
 		/* also means only matching at end */
 	
-	/* path */
 	if(query->absolute){
-		char const *begin = c_item;
+		std::size_t start = 0;
 		if(query->locate_query.base_name){
-			if(*begin != '/'){
+			if(! item.starts_with('/')){
 				return false;
 			}
-			++ begin;
-		}
-		if(!
-			do_fnmatch(
-				pattern_length, c_pattern, begin, query->locate_query.ignore_case, only_dir
-			)
-		){
-			return false;
+			++ start;
 		}
+		return match_pattern_at(&query->matcher, item, start, only_dir);
 	}else if(! query->locate_query.base_name || only_dir){
-		bool matched = false;
-		for(char const *i = c_item + item_length - 1; i >= c_item; -- i){
-			if(query->locate_query.base_name && *i == '/'){
-				break;
-			}
-			if(
-				do_fnmatch(
-					pattern_length, c_pattern, i, query->locate_query.ignore_case, only_dir
-				)
-			){
-				matched = true;
-				break;
-			}
-		}
-		if(! matched){
-			return false;
+		std::size_t first = 0;
+		if(query->locate_query.base_name){
+			std::size_t last_slash = item.rfind('/');
+			if(last_slash != std::string_view::npos) first = last_slash + 1;
 		}
+		return search_pattern(&query->matcher, item, first, only_dir);
+	}else{
+		return true; /* already matched by locate */
 	}
+}
+
+bool filter_query(std::string_view item, query_t const *query, bool *directory)
+{
+	bool only_dir = query->file_type_filter == ftf_only_dir;
 	
-	/* file type */
-	return filter_by_stat(c_item, only_dir);
+	return match_query(item, query) && filter_by_stat(item, only_dir, directory);
 }
 
 bool refilter_query(std::string_view item, query_t const *query)
 {
-	std::size_t item_length = item.size();
-	char *c_item = static_cast<char *>(alloca(item_length + 1));
-	std::memcpy(c_item, item.data(), item_length);
-	c_item[item_length] = '\0';
+	bool only_dir = query->file_type_filter == ftf_only_dir;
 	
+	bool directory;
+	return filter_by_stat(item, only_dir, &directory);
+}
+
+/* stat by the threads of the pool, for slow file systems (NFS, sshfs),
+   a small list is done by the calling thread only */
+
+static std::size_t const stat_batch = 128; /* the items taken at once */
+
+void stat_items(std::string_view const *items, std::size_t n, file_kind_t *results)
+{
+	get_work_pool()->run(
+		(n + stat_batch - 1) / stat_batch,
+		[items, n, results](std::size_t batch){
+			std::size_t last = std::min((batch + 1) * stat_batch, n);
+			for(std::size_t i = batch * stat_batch; i < last; ++ i){
+				results[i] = stat_item(items[i]);
+			}
+		}
+	);
+}
+
+bool filter_file_kind(file_kind_t kind, query_t const *query)
+{
+	bool only_dir = query->file_type_filter == ftf_only_dir;
+	
+	return filter_by_kind(kind, only_dir);
+}
+
+bool kind_by_locate_type(locate_type_t type, query_t const *query, file_kind_t *kind)
+{
 	bool only_dir = query->file_type_filter == ftf_only_dir;
 	
-	return filter_by_stat(c_item, only_dir);
+	switch(type){
+	case lrt_directory:
+		*kind = fk_directory;
+		return true;
+	case lrt_other:
+		if(only_dir){
+			*kind = fk_none; /* a symbolic link is not followed either */
+			return true;
+		}
+		return false; /* a regular file or a special file */
+	default:
+		return false;
+	}
 }
 
 /* ICU */
@@ -1,7 +1,11 @@
 #ifndef QUERY_HXX
 #define QUERY_HXX
 
+#include "compiled_pattern.hxx"
+#include "use_locate.hxx"
+
 #include <compare>
+#include <cstddef>
 #include <string>
 #include <string_view>
 
@@ -15,6 +19,10 @@ struct locate_query_t {
 	) = default;
 };
 
+struct locate_query_hash_t {
+	std::size_t operator () (locate_query_t const &x) const;
+};
+
 enum file_type_filter_t {ftf_all, ftf_only_dir};
 
 std::string_view image(file_type_filter_t x);
@@ -23,18 +31,43 @@ struct query_t {
 	locate_query_t locate_query;
 	bool absolute;
 	file_type_filter_t file_type_filter;
+	compiled_pattern_t matcher; /* of locate_query */
 	
 	query_t() = default;
+	query_t(query_t const &) = default;
 	query_t(query_t &&) = default;
 	
+	query_t &operator = (query_t const &) = default;
+	
 	friend std::strong_ordering operator <=> (
 		query_t const &left, query_t const &right
 	) = default;
 };
 
+struct query_hash_t {
+	std::size_t operator () (query_t const &x) const;
+};
+
 void parse_query(std::string_view pattern, query_t *result);
 
-bool filter_query(std::string_view item, query_t const *query);
+/* only the path, without checking the file */
+bool match_query(std::string_view item, query_t const *query);
+
+bool filter_query(std::string_view item, query_t const *query, bool *directory);
 bool refilter_query(std::string_view item, query_t const *query);
 
+/* the types of files that filter_query passes */
+enum file_kind_t : unsigned char {fk_none, fk_file, fk_directory};
+
+/* lstat for many items by a few threads, results[i] is of items[i],
+   fk_none for the removed ones or the other types */
+void stat_items(std::string_view const *items, std::size_t n, file_kind_t *results);
+
+/* same as refilter_query with the result of stat_items */
+bool filter_file_kind(file_kind_t kind, query_t const *query);
+
+/* the kind decided by the type recorded in the database without stat,
+   returns false if it can not be decided */
+bool kind_by_locate_type(locate_type_t type, query_t const *query, file_kind_t *kind);
+
 #endif
@@ -0,0 +1,390 @@
+#ifndef SHARDED_MAP_HXX
+#define SHARDED_MAP_HXX
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <cstddef>
+#include <functional>
+#include <memory>
+#include <mutex>
+#include <shared_mutex>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+inline constexpr std::size_t shard_count = 16;
+
+inline std::size_t shard_index(std::size_t hash)
+{
+	return (hash ^ (hash >> 17)) % shard_count;
+}
+
+/* a hash map split into shards, each is guarded by a reader/writer lock,
+   values are copied out (so those should be cheap to copy) */
+
+template<class Key, class Value, class Hash = std::hash<Key>>
+class sharded_map_t {
+	struct shard_t {
+		mutable std::shared_mutex mutex;
+		std::unordered_map<Key, Value, Hash> map;
+	};
+	
+	shard_t shards[shard_count];
+	
+	shard_t &shard(Key const &key)
+	{
+		return this->shards[shard_index(Hash()(key))];
+	}
+	
+	shard_t const &shard(Key const &key) const
+	{
+		return this->shards[shard_index(Hash()(key))];
+	}
+	
+public:
+	bool find(Key const &key, Value *result) const
+	{
+		shard_t const &s = this->shard(key);
+		std::shared_lock<std::shared_mutex> lock(s.mutex);
+		typename std::unordered_map<Key, Value, Hash>::const_iterator iter =
+			s.map.find(key);
+		if(iter == s.map.cend()) return false;
+		*result = iter->second;
+		return true;
+	}
+	
+	/* returns the value already existing, or the new value */
+	Value emplace(Key const &key, Value &&value)
+	{
+		shard_t &s = this->shard(key);
+		std::unique_lock<std::shared_mutex> lock(s.mutex);
+		return s.map.try_emplace(key, std::move(value)).first->second;
+	}
+	
+	void insert_or_assign(Key const &key, Value &&value)
+	{
+		shard_t &s = this->shard(key);
+		std::unique_lock<std::shared_mutex> lock(s.mutex);
+		s.map.insert_or_assign(key, std::move(value));
+	}
+	
+	template<class P>
+	std::size_t erase_if(P predicate)
+	{
+		std::size_t result = 0;
+		for(std::size_t i = 0; i < shard_count; ++ i){
+			shard_t &s = this->shards[i];
+			std::unique_lock<std::shared_mutex> lock(s.mutex);
+			result += std::erase_if(s.map, predicate);
+		}
+		return result;
+	}
+	
+	std::size_t size() const
+	{
+		std::size_t result = 0;
+		for(std::size_t i = 0; i < shard_count; ++ i){
+			shard_t const &s = this->shards[i];
+			std::shared_lock<std::shared_mutex> lock(s.mutex);
+			result += s.map.size();
+		}
+		return result;
+	}
+};
+
+struct cache_statistics_t {
+	std::size_t entries;
+	std::size_t bytes;
+	std::size_t hits;
+	std::size_t misses;
+	std::size_t evictions;
+};
+
+/* a cache whose each value is computed by only one thread (single-flight),
+   the other threads asking the same key wait it,
+   T::memory_size is counted for evict() */
+
+template<class Key, class T, class Hash = std::hash<Key>>
+class flight_cache_t {
+	struct flight_t {
+		std::mutex mutex;
+		std::condition_variable condition;
+		bool finished = false;
+		std::shared_ptr<T const> value; /* nullptr if abandoned */
+		std::atomic<bool> referenced = true; /* for CLOCK */
+		std::atomic<std::size_t> uses = 1;
+	};
+	
+	typedef std::unordered_map<Key, std::shared_ptr<flight_t>, Hash> map_t;
+	
+	struct shard_t {
+		mutable std::shared_mutex mutex;
+		map_t map;
+	};
+	
+	shard_t shards[shard_count];
+	std::atomic<std::size_t> bytes = 0;
+	std::atomic<std::size_t> hits = 0;
+	std::atomic<std::size_t> misses = 0;
+	std::atomic<std::size_t> evictions = 0;
+	std::atomic<std::size_t> hand = 0; /* the shard evicted next */
+	
+	shard_t &shard(Key const &key)
+	{
+		return this->shards[shard_index(Hash()(key))];
+	}
+	
+	static std::size_t memory_size(flight_t const *flight)
+	{
+		return (flight->finished && flight->value != nullptr) ?
+			flight->value->memory_size : 0;
+	}
+	
+	/* the finished value of flight is stale */
+	static bool stale_flight(flight_t *flight, std::shared_ptr<T const> const &stale)
+	{
+		if(stale == nullptr) return false;
+		std::lock_guard<std::mutex> lock(flight->mutex);
+		return flight->finished && flight->value == stale;
+	}
+	
+	template<class Compute, class Cancelled>
+	std::shared_ptr<T const> get_unless(
+		Key const &key, std::shared_ptr<T const> const &stale, Compute compute,
+		Cancelled cancelled
+	)
+	{
+		shard_t &s = this->shard(key);
+		for(;;){
+			std::shared_ptr<flight_t> flight;
+			bool leader = false;
+			{
+				std::shared_lock<std::shared_mutex> lock(s.mutex);
+				typename map_t::const_iterator iter = s.map.find(key);
+				if(iter != s.map.cend() && ! stale_flight(iter->second.get(), stale)){
+					flight = iter->second;
+					flight->referenced.store(true, std::memory_order_relaxed);
+					flight->uses.fetch_add(1, std::memory_order_relaxed);
+				}
+			}
+			if(flight == nullptr){
+				std::unique_lock<std::shared_mutex> lock(s.mutex);
+				std::pair<typename map_t::iterator, bool> emplaced = s.map.try_emplace(key);
+				if(emplaced.second){
+					emplaced.first->second = std::make_shared<flight_t>();
+					leader = true;
+				}else if(stale_flight(emplaced.first->second.get(), stale)){
+					/* computing again in place of the stale one */
+					std::shared_ptr<flight_t> computing = std::make_shared<flight_t>();
+					{
+						std::lock_guard<std::mutex> flight_lock(emplaced.first->second->mutex);
+						this->bytes.fetch_sub(memory_size(emplaced.first->second.get()));
+						computing->uses.store(
+							emplaced.first->second->uses.load(std::memory_order_relaxed) + 1
+						);
+					}
+					emplaced.first->second = std::move(computing);
+					leader = true;
+				}
+				flight = emplaced.first->second;
+			}
+			
+			if(leader){
+				this->misses.fetch_add(1, std::memory_order_relaxed);
+				std::shared_ptr<T const> value = compute();
+				if(value == nullptr){
+					std::unique_lock<std::shared_mutex> lock(s.mutex);
+					typename map_t::iterator iter = s.map.find(key);
+					if(iter != s.map.end() && iter->second == flight) s.map.erase(iter);
+				}
+				{
+					/* under the lock of the shard, so evict() sees the size */
+					std::shared_lock<std::shared_mutex> shard_lock(s.mutex);
+					std::lock_guard<std::mutex> lock(flight->mutex);
+					flight->finished = true;
+					flight->value = value;
+					typename map_t::const_iterator iter = s.map.find(key);
+					if(iter != s.map.cend() && iter->second == flight){
+						this->bytes.fetch_add(memory_size(flight.get()));
+					}
+				}
+				flight->condition.notify_all();
+				return value;
+			}
+			
+			{
+				std::unique_lock<std::mutex> lock(flight->mutex);
+				while(! flight->finished){
+					if(cancelled()) return nullptr;
+					flight->condition.wait_for(lock, std::chrono::milliseconds(10));
+				}
+				if(flight->value != nullptr){
+					this->hits.fetch_add(1, std::memory_order_relaxed);
+					return flight->value;
+				}
+			}
+			/* abandoned by the other thread, so trying to compute again */
+		}
+	}
+	
+public:
+	/* compute() returns nullptr to abandon (when cancelled),
+	   returns nullptr if cancelled() while waiting the other thread */
+	template<class Compute, class Cancelled>
+	std::shared_ptr<T const> get(Key const &key, Compute compute, Cancelled cancelled)
+	{
+		return this->get_unless(key, nullptr, compute, cancelled);
+	}
+	
+	/* same as get(), but if the value is still stale, it is computed again
+	   by only one thread, and the others asking it wait the new one */
+	template<class Compute, class Cancelled>
+	std::shared_ptr<T const> get_again(
+		Key const &key, std::shared_ptr<T const> const &stale, Compute compute,
+		Cancelled cancelled
+	)
+	{
+		return this->get_unless(key, stale, compute, cancelled);
+	}
+	
+	/* replacing the finished value, keeping the count of uses */
+	void replace(Key const &key, std::shared_ptr<T const> value)
+	{
+		std::shared_ptr<flight_t> flight = std::make_shared<flight_t>();
+		flight->finished = true;
+		flight->value = std::move(value);
+		std::size_t size = memory_size(flight.get());
+		shard_t &s = this->shard(key);
+		std::unique_lock<std::shared_mutex> lock(s.mutex);
+		std::pair<typename map_t::iterator, bool> emplaced = s.map.try_emplace(key);
+		if(! emplaced.second){
+			std::lock_guard<std::mutex> flight_lock(emplaced.first->second->mutex);
+			this->bytes.fetch_sub(memory_size(emplaced.first->second.get()));
+			flight->uses.store(emplaced.first->second->uses.load(std::memory_order_relaxed));
+		}
+		emplaced.first->second = std::move(flight);
+		this->bytes.fetch_add(size);
+	}
+	
+	/* removing the finished values not referenced recently (CLOCK)
+	   until the total memory_size is at most budget,
+	   returns the number of the removed */
+	std::size_t evict(std::size_t budget)
+	{
+		std::size_t result = 0;
+		/* the first round clears the reference bits */
+		for(
+			std::size_t round = 0;
+			round < 2 * shard_count && this->bytes.load() > budget;
+			++ round
+		){
+			shard_t &s = this->shards[this->hand.fetch_add(1) % shard_count];
+			std::unique_lock<std::shared_mutex> lock(s.mutex);
+			for(
+				typename map_t::iterator i = s.map.begin();
+				i != s.map.end() && this->bytes.load() > budget;
+			){
+				std::size_t size;
+				{
+					std::lock_guard<std::mutex> flight_lock(i->second->mutex);
+					size = memory_size(i->second.get());
+				}
+				if(size == 0 || i->second->referenced.exchange(false)){
+					++ i;
+				}else{
+					this->bytes.fetch_sub(size);
+					i = s.map.erase(i);
+					++ result;
+				}
+			}
+		}
+		this->evictions.fetch_add(result, std::memory_order_relaxed);
+		return result;
+	}
+	
+	/* the finished value without counting it as used, nullptr if none */
+	std::shared_ptr<T const> peek(Key const &key) const
+	{
+		shard_t const &s = this->shards[shard_index(Hash()(key))];
+		std::shared_lock<std::shared_mutex> lock(s.mutex);
+		typename map_t::const_iterator iter = s.map.find(key);
+		if(iter == s.map.cend()) return nullptr;
+		std::lock_guard<std::mutex> flight_lock(iter->second->mutex);
+		return iter->second->finished ? iter->second->value : nullptr;
+	}
+	
+	/* the keys of the finished values used most */
+	std::vector<Key> hottest(std::size_t n) const
+	{
+		std::vector<std::pair<std::size_t, Key>> used;
+		for(std::size_t i = 0; i < shard_count; ++ i){
+			shard_t const &s = this->shards[i];
+			std::shared_lock<std::shared_mutex> lock(s.mutex);
+			for(
+				typename map_t::const_iterator j = s.map.cbegin();
+				j != s.map.cend();
+				++ j
+			){
+				std::lock_guard<std::mutex> flight_lock(j->second->mutex);
+				if(j->second->finished && j->second->value != nullptr){
+					used.emplace_back(j->second->uses.load(std::memory_order_relaxed), j->first);
+				}
+			}
+		}
+		n = std::min(n, used.size());
+		std::partial_sort(
+			used.begin(), used.begin() + n, used.end(),
+			[](std::pair<std::size_t, Key> const &left, std::pair<std::size_t, Key> const &right){
+				return left.first > right.first;
+			}
+		);
+		std::vector<Key> result;
+		result.reserve(n);
+		for(std::size_t i = 0; i < n; ++ i){
+			result.push_back(used[i].second);
+		}
+		return result;
+	}
+	
+	cache_statistics_t statistics() const
+	{
+		cache_statistics_t result;
+		result.entries = 0;
+		for(std::size_t i = 0; i < shard_count; ++ i){
+			shard_t const &s = this->shards[i];
+			std::shared_lock<std::shared_mutex> lock(s.mutex);
+			result.entries += s.map.size();
+		}
+		result.bytes = this->bytes.load();
+		result.hits = this->hits.load(std::memory_order_relaxed);
+		result.misses = this->misses.load(std::memory_order_relaxed);
+		result.evictions = this->evictions.load(std::memory_order_relaxed);
+		return result;
+	}
+	
+	/* calling f(key, value) for each finished value */
+	template<class F>
+	void for_each(F f) const
+	{
+		for(std::size_t i = 0; i < shard_count; ++ i){
+			shard_t const &s = this->shards[i];
+			std::shared_lock<std::shared_mutex> lock(s.mutex);
+			for(
+				typename map_t::const_iterator j = s.map.cbegin();
+				j != s.map.cend();
+				++ j
+			){
+				std::shared_ptr<T const> value;
+				{
+					std::lock_guard<std::mutex> flight_lock(j->second->mutex);
+					if(j->second->finished) value = j->second->value;
+				}
+				if(value != nullptr) f(j->first, value);
+			}
+		}
+	}
+};
+
+#endif
@@ -1,7 +1,186 @@
+#include "cache_core.hxx"
 #include "query.hxx"
 #include "use_locate.hxx"
 
+#include <algorithm>
+#include <charconv>
+#include <chrono>
+#include <cstdint>
 #include <cstdio>
+#include <cstdlib>
+#include <memory>
+#include <string>
+
+#include <sys/time.h>
+
+#include <unicode/utf8.h>
+
+/* batch mode */
+/* The queries are read from stdin and run through the same caches as the
+   plugin, and each result is written as a line of JSON. */
+
+/* the valid UTF-8 is written as is, and each byte of the invalid one (in a
+   path of Linux) as a lone surrogate U+DC80..U+DCFF like Python's
+   "surrogateescape" */
+static void print_json_string(std::string_view x)
+{
+	std::int32_t const length = static_cast<std::int32_t>(x.size());
+	std::putchar('"');
+	std::int32_t i = 0;
+	while(i < length){
+		std::int32_t start = i;
+		UChar32 c;
+		U8_NEXT(x.data(), i, length, c);
+		if(c < 0){
+			i = start + 1;
+			std::printf("\\udc%02x", static_cast<unsigned char>(x[start]));
+		}else if(c == '"' || c == '\\'){
+			std::putchar('\\');
+			std::putchar(c);
+		}else if(c < 0x20 || c == 0x7f){
+			std::printf("\\u%04x", static_cast<unsigned>(c));
+		}else{
+			std::fwrite(x.data() + start, 1, i - start, stdout);
+		}
+	}
+	std::putchar('"');
+}
+
+static char const *cache_use(cache_statistics_t const *before, cache_statistics_t const *after)
+{
+	if(after->misses != before->misses) return "miss";
+	if(after->hits != before->hits) return "hit";
+	return "unused";
+}
+
+/* the counts of the caches, without entries and bytes */
+static void add_statistics(cache_statistics_t const *x, cache_statistics_t *sum)
+{
+	sum->hits += x->hits;
+	sum->misses += x->misses;
+	sum->evictions += x->evictions;
+}
+
+static int run_batch_query(
+	std::shared_ptr<core_cache_t> const &cache, core_context_t const *context,
+	std::string_view pattern
+)
+{
+	std::time_t now;
+	struct timeval tv;
+	now = (gettimeofday(&tv, nullptr) < 0) ? 0 : tv.tv_sec;
+	cache_statistics_t locate_before = cache->locate_cache.statistics();
+	cache_statistics_t query_before = cache->query_cache.statistics();
+	
+	std::chrono::steady_clock::time_point start = std::chrono::steady_clock::now();
+	query_t query;
+	parse_query(pattern, &query);
+	auto cancelled = [](){ return false; };
+	std::shared_ptr<queried_t const> queried =
+		query_with_cache(cache, context, &query, now, make_locate_cancelled(cancelled));
+	std::chrono::microseconds elapsed =
+		std::chrono::duration_cast<std::chrono::microseconds>(
+			std::chrono::steady_clock::now() - start
+		);
+	
+	cache_statistics_t locate_after = cache->locate_cache.statistics();
+	cache_statistics_t query_after = cache->query_cache.statistics();
+	std::fputs("{\"query\":", stdout);
+	print_json_string(pattern);
+	std::printf(
+		",\"time_us\":%lld,\"query_cache\":\"%s\",\"locate_cache\":\"%s\"",
+		static_cast<long long>(elapsed.count()),
+		cache_use(&query_before, &query_after), cache_use(&locate_before, &locate_after)
+	);
+	if(queried == nullptr){
+		std::fputs(",\"error\":\"cancelled\"}\n", stdout);
+		return ECANCELED;
+	}
+	/* only the sorted ones, as the plugin shows */
+	std::size_t n = std::min(context->match_limit, queried->sorted_length);
+	std::printf(",\"matches\":%zu,\"results\":[", queried->list.size());
+	for(std::size_t i = 0; i < n; ++ i){
+		if(i > 0){
+			std::putchar(',');
+		}
+		print_json_string(cache->paths.get(queried->list[i].path));
+	}
+	std::fputs("]}\n", stdout);
+	return 0;
+}
+
+static int run_batch(
+	bool null_separated, std::size_t locate_limit, std::size_t match_limit,
+	std::size_t budget
+)
+{
+	home_paths_t home;
+	char const *home_env = std::getenv("HOME");
+	setup_home_paths((home_env != nullptr) ? home_env : "/", &home);
+	core_context_t context;
+	context.home = &home;
+	context.match_limit = match_limit;
+	context.locate_limit = locate_limit;
+	context.overlay = nullptr;
+	/* refiltering in the calling thread, as post is empty */
+	
+	std::shared_ptr<core_cache_t> cache = std::make_shared<core_cache_t>();
+	init_core_cache(cache.get());
+	cache_statistics_t locate_cleared{}; /* of the cleared caches */
+	cache_statistics_t query_cleared{};
+	std::size_t clears = 0;
+	int const separator = null_separated ? '\0' : '\n';
+	int error = 0;
+	std::string pattern;
+	int c;
+	do{
+		c = std::getchar();
+		if(c != separator && c != EOF){
+			pattern.push_back(static_cast<char>(c));
+		}else if(! pattern.empty()){
+			int query_error = run_batch_query(cache, &context, pattern);
+			if(error == 0){
+				error = query_error;
+			}
+			std::fflush(stdout);
+			trim_core_cache(cache.get(), budget);
+			if(cache->paths.memory_size() > budget){
+				/* as the plugin, the paths are freed only with the whole */
+				cache_statistics_t locate_statistics = cache->locate_cache.statistics();
+				cache_statistics_t query_statistics = cache->query_cache.statistics();
+				add_statistics(&locate_statistics, &locate_cleared);
+				add_statistics(&query_statistics, &query_cleared);
+				++ clears;
+				cache = std::make_shared<core_cache_t>();
+				init_core_cache(cache.get());
+			}
+			pattern.clear();
+		}
+	}while(c != EOF);
+	
+	cache_statistics_t locate_statistics = cache->locate_cache.statistics();
+	cache_statistics_t query_statistics = cache->query_cache.statistics();
+	add_statistics(&locate_cleared, &locate_statistics);
+	add_statistics(&query_cleared, &query_statistics);
+	std::printf(
+		"{\"summary\":{\"locate_hits\":%zu,\"locate_misses\":%zu,"
+			"\"locate_evictions\":%zu,\"query_hits\":%zu,\"query_misses\":%zu,"
+			"\"query_evictions\":%zu,\"clears\":%zu,\"paths\":%zu,"
+			"\"path_bytes\":%zu}}\n",
+		locate_statistics.hits, locate_statistics.misses, locate_statistics.evictions,
+		query_statistics.hits, query_statistics.misses, query_statistics.evictions,
+		clears, cache->paths.size(), cache->paths.memory_size()
+	);
+	return error;
+}
+
+static bool parse_size(char const *image, std::size_t *result)
+{
+	std::string_view value(image);
+	std::from_chars_result r =
+		std::from_chars(value.data(), value.data() + value.size(), *result);
+	return r.ec == std::errc() && r.ptr == value.data() + value.size() && *result > 0;
+}
 
 int main(int argc, char const * const *argv)
 {
@@ -9,10 +188,39 @@ int main(int argc, char const * const *argv)
 	
 	bool mtime = false;
 	bool verbose = false;
+	bool batch = false;
+	bool null_separated = false;
+	std::size_t limit = default_locate_limit;
+	std::size_t match_limit = 100;
+	std::size_t budget_mib = 64;
 	int i = 1;
 	while(i < argc){
 		std::string_view e(argv[i]);
-		if(e == "--mtime"sv){
+		if(e == "--limit"sv && i + 1 < argc){
+			if(! parse_size(argv[i + 1], &limit)){
+				std::fprintf(stderr, "%s: invalid limit: %s\n", argv[0], argv[i + 1]);
+				return 2;
+			}
+			i += 2;
+		}else if(e == "--matches"sv && i + 1 < argc){
+			if(! parse_size(argv[i + 1], &match_limit)){
+				std::fprintf(stderr, "%s: invalid matches: %s\n", argv[0], argv[i + 1]);
+				return 2;
+			}
+			i += 2;
+		}else if(e == "--budget"sv && i + 1 < argc){
+			if(! parse_size(argv[i + 1], &budget_mib)){
+				std::fprintf(stderr, "%s: invalid budget: %s\n", argv[0], argv[i + 1]);
+				return 2;
+			}
+			i += 2;
+		}else if(e == "--batch"sv){
+			++ i;
+			batch = true;
+		}else if(e == "--null"sv){
+			++ i;
+			null_separated = true;
+		}else if(e == "--mtime"sv){
 			++ i;
 			mtime = true;
 		}else if(e == "--verbose"sv){
@@ -28,7 +236,7 @@ int main(int argc, char const * const *argv)
 			break;
 		}
 	}
-	int required_argc = mtime ? i : i + 1;
+	int required_argc = (mtime || batch) ? i : i + 1;
 	if(argc < required_argc){
 		std::fprintf(stderr, "%s: too few arguments.\n", argv[0]);
 		return 2;
@@ -38,7 +246,9 @@ int main(int argc, char const * const *argv)
 	}
 	
 	int error;
-	if(mtime){
+	if(batch){
+		error = run_batch(null_separated, limit, match_limit, budget_mib << 20);
+	}else if(mtime){
 		std::time_t time;
 		if((error = locate_mtime(&time)) != 0){
 			std::fprintf(stderr, "%s: could not find any database.\n", argv[0]);
@@ -76,6 +286,11 @@ int main(int argc, char const * const *argv)
 				stderr, "%s: file_type_filter=%.*s\n", argv[0],
 				static_cast<int>(file_type_filter.size()), file_type_filter.data()
 			);
+			std::string_view matcher = image(query.matcher.kind);
+			std::fprintf(
+				stderr, "%s: matcher=%.*s\n", argv[0],
+				static_cast<int>(matcher.size()), matcher.data()
+			);
 		}
 		
 		int status;
@@ -83,8 +298,15 @@ int main(int argc, char const * const *argv)
 			query.locate_query.pattern,
 			query.locate_query.base_name,
 			query.locate_query.ignore_case,
-			[&query](std::string_view item){
-				if(filter_query(item, &query)){
+			limit,
+			[&query](std::string_view item, locate_type_t type){
+				bool directory;
+				file_kind_t kind;
+				bool passed =
+					kind_by_locate_type(type, &query, &kind) ?
+						match_query(item, &query) && filter_file_kind(kind, &query) :
+						filter_query(item, &query, &directory);
+				if(passed){
 					std::printf("%.*s\n", static_cast<int>(item.size()), item.data());
 				}
 				return 0;
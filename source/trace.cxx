@@ -0,0 +1,344 @@
+#include "trace.hxx"
+#include "use_locate.hxx"
+
+#include <algorithm>
+#include <bit>
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <deque>
+#include <memory>
+#include <mutex>
+#include <new>
+#include <string>
+#include <system_error>
+#include <thread>
+#include <vector>
+
+#include <fcntl.h>
+#include <time.h>
+#include <unistd.h>
+
+std::atomic<bool> trace_enabled = false;
+std::atomic<std::uint64_t> trace_counters[trace_counter_count] = {};
+
+static char const * const span_names[trace_span_count] = {
+	"parse", "locate", "spawn", "first_byte", "filter", "sort", "emit"
+};
+
+static char const * const counter_names[trace_counter_count] = {
+	"locate_hit", "locate_miss", "query_hit", "query_miss", "locate_wider",
+	"locate_stored", "locate_index", "locate_helper", "locate_run", "locate_command"
+};
+
+std::uint64_t trace_clock()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return static_cast<std::uint64_t>(ts.tv_sec) * 1000000000u + ts.tv_nsec + 1;
+}
+
+/* ring buffers */
+
+struct trace_event_t {
+	std::uint64_t start;
+	std::uint64_t duration;
+	std::uint32_t count;
+	trace_span_t span;
+};
+
+/* written only by the owner thread, and read only by the flusher */
+struct trace_ring_t {
+	static constexpr std::size_t capacity = 1024;
+	
+	trace_event_t events[capacity];
+	std::atomic<std::uint64_t> head = 0; /* the number of the written events */
+	std::atomic<std::uint64_t> tail = 0; /* the number of the read events */
+	std::atomic<bool> owned = false;
+	std::size_t number; /* in the dump */
+};
+
+static std::size_t const max_rings = 256;
+
+static std::mutex ring_mutex;
+static std::vector<std::unique_ptr<trace_ring_t>> rings; /* reused by the new threads */
+static std::atomic<std::uint64_t> dropped_spans = 0;
+
+/* the ring is released when the thread exits */
+struct ring_owner_t {
+	trace_ring_t *ring = nullptr;
+	
+	~ring_owner_t()
+	{
+		if(this->ring != nullptr){
+			this->ring->owned.store(false, std::memory_order_release);
+		}
+	}
+};
+
+static thread_local ring_owner_t ring_owner;
+
+static trace_ring_t *acquire_ring()
+{
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	for(
+		std::vector<std::unique_ptr<trace_ring_t>>::const_iterator i = rings.cbegin();
+		i != rings.cend();
+		++ i
+	){
+		if(! (*i)->owned.load(std::memory_order_acquire)){
+			(*i)->owned.store(true, std::memory_order_relaxed);
+			return i->get();
+		}
+	}
+	if(rings.size() >= max_rings) return nullptr;
+	std::unique_ptr<trace_ring_t> ring = std::make_unique<trace_ring_t>();
+	ring->owned.store(true, std::memory_order_relaxed);
+	ring->number = rings.size();
+	rings.push_back(std::move(ring));
+	return rings.back().get();
+}
+
+void record_trace_span(trace_span_t span, std::uint64_t start, std::uint32_t count)
+{
+	std::uint64_t end = trace_clock();
+	trace_ring_t *ring = ring_owner.ring;
+	if(ring == nullptr){
+		try{
+			ring = acquire_ring();
+		}catch(std::bad_alloc const &){
+			ring = nullptr;
+		}
+		if(ring == nullptr){
+			dropped_spans.fetch_add(1, std::memory_order_relaxed);
+			return;
+		}
+		ring_owner.ring = ring;
+	}
+	std::uint64_t head = ring->head.load(std::memory_order_relaxed);
+	if(head - ring->tail.load(std::memory_order_acquire) >= trace_ring_t::capacity){
+		dropped_spans.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	ring->events[head % trace_ring_t::capacity] = trace_event_t{start, end - start, count, span};
+	ring->head.store(head + 1, std::memory_order_release);
+}
+
+/* summary, touched only by the flusher thread while it runs */
+
+struct span_summary_t {
+	std::uint64_t count;
+	std::uint64_t total; /* nanoseconds */
+	std::uint64_t max;
+	std::uint64_t buckets[65]; /* by the bit width of the duration */
+};
+
+struct recent_event_t {
+	trace_event_t event;
+	std::size_t ring;
+};
+
+static std::size_t const max_recent_events = 256;
+
+static span_summary_t summaries[trace_span_count];
+static std::deque<recent_event_t> recent_events;
+static std::uint64_t last_counter_sum;
+static std::uint64_t trace_start_time;
+static std::string dump_path;
+
+static bool drain_rings()
+{
+	bool added = false;
+	std::lock_guard<std::mutex> lock(ring_mutex);
+	for(
+		std::vector<std::unique_ptr<trace_ring_t>>::const_iterator i = rings.cbegin();
+		i != rings.cend();
+		++ i
+	){
+		trace_ring_t *ring = i->get();
+		std::uint64_t tail = ring->tail.load(std::memory_order_relaxed);
+		std::uint64_t head = ring->head.load(std::memory_order_acquire);
+		for(; tail != head; ++ tail){
+			trace_event_t const *event = &ring->events[tail % trace_ring_t::capacity];
+			span_summary_t *summary = &summaries[event->span];
+			++ summary->count;
+			summary->total += event->duration;
+			summary->max = std::max(summary->max, event->duration);
+			++ summary->buckets[std::bit_width(event->duration)];
+			if(recent_events.size() >= max_recent_events){
+				recent_events.pop_front();
+			}
+			recent_events.push_back(recent_event_t{*event, ring->number});
+			added = true;
+		}
+		ring->tail.store(tail, std::memory_order_release);
+	}
+	return added;
+}
+
+static bool counters_changed()
+{
+	std::uint64_t sum = dropped_spans.load(std::memory_order_relaxed);
+	for(int i = 0; i < trace_counter_count; ++ i){
+		sum += trace_counters[i].load(std::memory_order_relaxed);
+	}
+	bool changed = sum != last_counter_sum;
+	last_counter_sum = sum;
+	return changed;
+}
+
+/* the upper bound of the bucket containing the p-th percentile */
+static std::uint64_t percentile(span_summary_t const *summary, std::uint64_t p)
+{
+	std::uint64_t rank = (summary->count * p + 99) / 100;
+	std::uint64_t n = 0;
+	for(int i = 0; i < 65; ++ i){
+		n += summary->buckets[i];
+		if(n >= rank && n > 0){
+			return (i == 0) ? 0 : std::min(summary->max, (std::uint64_t{1} << i) - 1);
+		}
+	}
+	return summary->max;
+}
+
+static void write_summary(std::FILE *file)
+{
+	std::fprintf(
+		file, "%-12s %10s %12s %10s %10s %10s\n",
+		"span", "count", "total_ms", "p50_us", "p99_us", "max_us"
+	);
+	for(int i = 0; i < trace_span_count; ++ i){
+		span_summary_t const *summary = &summaries[i];
+		std::fprintf(
+			file, "%-12s %10llu %12.3f %10.1f %10.1f %10.1f\n",
+			span_names[i],
+			static_cast<unsigned long long>(summary->count),
+			summary->total / 1e6,
+			percentile(summary, 50) / 1e3,
+			percentile(summary, 99) / 1e3,
+			summary->max / 1e3
+		);
+	}
+	std::fprintf(file, "\n");
+	for(int i = 0; i < trace_counter_count; ++ i){
+		std::fprintf(
+			file, "%-16s %llu\n", counter_names[i],
+			static_cast<unsigned long long>(trace_counters[i].load(std::memory_order_relaxed))
+		);
+	}
+	std::fprintf(
+		file, "%-16s %llu\n", "dropped_spans",
+		static_cast<unsigned long long>(dropped_spans.load(std::memory_order_relaxed))
+	);
+	std::fprintf(file, "\n%6s %12s %12s %8s %s\n", "thread", "start_ms", "duration_us", "count", "span");
+	for(
+		std::deque<recent_event_t>::const_iterator i = recent_events.cbegin();
+		i != recent_events.cend();
+		++ i
+	){
+		std::fprintf(
+			file, "%6zu %12.3f %12.1f %8u %s\n",
+			i->ring,
+			(i->event.start - std::min(i->event.start, trace_start_time)) / 1e6,
+			i->event.duration / 1e3,
+			static_cast<unsigned>(i->event.count),
+			span_names[i->event.span]
+		);
+	}
+}
+
+/* writing to a temporary file and renaming it, so readers see the whole */
+static int write_dump()
+{
+	std::string temporary = dump_path;
+	temporary.push_back('.');
+	temporary.append(std::to_string(getpid()));
+	int fd = open(temporary.c_str(), O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0600);
+	if(fd < 0) return nonzero_errno(errno);
+	std::FILE *file = fdopen(fd, "w");
+	if(file == nullptr){
+		int error = nonzero_errno(errno);
+		close(fd);
+		unlink(temporary.c_str());
+		return error;
+	}
+	write_summary(file);
+	int error = std::ferror(file) ? EIO : 0;
+	if(std::fclose(file) != 0 && error == 0){
+		error = nonzero_errno(errno);
+	}
+	if(error == 0 && std::rename(temporary.c_str(), dump_path.c_str()) < 0){
+		error = nonzero_errno(errno);
+	}
+	if(error != 0){
+		unlink(temporary.c_str());
+	}
+	return error;
+}
+
+/* flusher */
+
+static std::mutex flusher_mutex; /* of start and stop */
+static std::thread flusher_thread;
+static std::mutex flusher_wait_mutex;
+static std::condition_variable flusher_condition;
+static bool flusher_stopping = false;
+
+static void run_flusher()
+{
+	std::unique_lock<std::mutex> lock(flusher_wait_mutex);
+	while(! flusher_stopping){
+		flusher_condition.wait_for(lock, std::chrono::seconds(1));
+		lock.unlock();
+		bool added = drain_rings();
+		if(counters_changed() || added){
+			write_dump();
+		}
+		lock.lock();
+	}
+}
+
+int start_trace(char const *path)
+{
+	std::lock_guard<std::mutex> lock(flusher_mutex);
+	if(flusher_thread.joinable()) return 0;
+	
+	/* the spans of the last time are discarded */
+	drain_rings();
+	for(int i = 0; i < trace_span_count; ++ i){
+		summaries[i] = span_summary_t{};
+	}
+	recent_events.clear();
+	for(int i = 0; i < trace_counter_count; ++ i){
+		trace_counters[i].store(0, std::memory_order_relaxed);
+	}
+	dropped_spans.store(0, std::memory_order_relaxed);
+	last_counter_sum = 0;
+	trace_start_time = trace_clock();
+	dump_path = path;
+	
+	flusher_stopping = false;
+	try{
+		flusher_thread = std::thread(run_flusher);
+	}catch(std::system_error const &e){
+		return nonzero_errno(e.code().value());
+	}
+	trace_enabled.store(true);
+	return 0;
+}
+
+void stop_trace()
+{
+	std::lock_guard<std::mutex> lock(flusher_mutex);
+	if(! flusher_thread.joinable()) return;
+	trace_enabled.store(false);
+	{
+		std::lock_guard<std::mutex> wait_lock(flusher_wait_mutex);
+		flusher_stopping = true;
+	}
+	flusher_condition.notify_one();
+	flusher_thread.join();
+	drain_rings();
+	write_dump();
+}
@@ -0,0 +1,77 @@
+#ifndef TRACE_HXX
+#define TRACE_HXX
+
+#include <atomic>
+#include <cstdint>
+
+/* spans and counters, always compiled and recorded only while enabled,
+   a disabled span costs a branch at each end */
+
+enum trace_span_t : unsigned char {
+	ts_parse, /* parse_query */
+	ts_locate, /* running locate for a query, the count is of the paths */
+	ts_spawn, /* spawning the command */
+	ts_first_byte, /* from the start of locate to the first path */
+	ts_filter, /* matching and stat, the count is of the paths */
+	ts_sort,
+	ts_emit, /* making QueryMatch, the count is of the matches */
+	trace_span_count
+};
+
+enum trace_counter_t : unsigned char {
+	tc_locate_hit, /* locate_cache */
+	tc_locate_miss,
+	tc_query_hit, /* query_cache */
+	tc_query_miss,
+	tc_locate_wider, /* filtered from the result of a wider query */
+	tc_locate_stored, /* read from the persistent cache */
+	tc_locate_index, /* from the trigram index */
+	tc_locate_helper, /* by the helper process */
+	tc_locate_run, /* reading the database or running the command */
+	tc_locate_command, /* spawning /usr/bin/locate */
+	trace_counter_count
+};
+
+extern std::atomic<bool> trace_enabled;
+extern std::atomic<std::uint64_t> trace_counters[trace_counter_count];
+
+inline bool tracing()
+{
+	return trace_enabled.load(std::memory_order_relaxed);
+}
+
+/* nanoseconds of CLOCK_MONOTONIC, not 0 */
+std::uint64_t trace_clock();
+
+/* appending to the ring buffer of the current thread without locking,
+   dropped if the flusher is behind */
+void record_trace_span(trace_span_t span, std::uint64_t start, std::uint32_t count);
+
+/* 0 if disabled */
+inline std::uint64_t trace_begin()
+{
+	return tracing() ? trace_clock() : 0;
+}
+
+inline void trace_end(trace_span_t span, std::uint64_t start, std::uint32_t count = 0)
+{
+	if(start != 0){
+		record_trace_span(span, start, count);
+	}
+}
+
+inline void trace_count(trace_counter_t counter)
+{
+	if(tracing()){
+		trace_counters[counter].fetch_add(1, std::memory_order_relaxed);
+	}
+}
+
+/* enabling, and starting the thread collecting the ring buffers every
+   second and rewriting the summary to dump_path when anything is added */
+int start_trace(char const *dump_path);
+
+/* disabling, and writing the last summary */
+void stop_trace();
+
+#endif
@@ -1,16 +1,27 @@
 #include "use_locate.hxx"
+#include "locate_pattern.hxx"
+#include "mlocate_db.hxx"
+#include "plocate_db.hxx"
 
 #include <cassert>
 #include <cerrno>
-#include <cstdio>
-#include <cstdlib>
+#include <charconv>
+#include <csignal>
+#include <cstdint>
 #include <cstring>
+#include <iterator>
+#include <limits>
+#include <string>
+#include <system_error>
 
 #include <fcntl.h>
-#include <linux/limits.h>
-#include <malloc.h>
+#include <poll.h>
 #include <spawn.h>
+#include <sys/eventfd.h>
+#include <sys/inotify.h>
+#include <sys/socket.h>
 #include <sys/stat.h>
+#include <sys/syscall.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -42,14 +53,47 @@ static int set_cloexec(int fd)
 	return 0;
 }
 
+static int do_pidfd_open(int pid)
+{
+#ifdef SYS_pidfd_open
+	int fd = syscall(SYS_pidfd_open, pid, 0);
+	if(fd >= 0){
+		set_cloexec(fd); /* pidfd_open sets it, only for safety */
+		return fd;
+	}
+#endif
+	return -1;
+}
+
+static void kill_command(locate_command_t const *command)
+{
+#ifdef SYS_pidfd_send_signal
+	if(command->pidfd >= 0){
+		if(syscall(SYS_pidfd_send_signal, command->pidfd, SIGTERM, nullptr, 0) == 0){
+			return;
+		}
+	}
+#endif
+	kill(command->pid, SIGTERM); /* not reaped yet, so the pid is not reused */
+}
+
 static char const locate_path[] = "/usr/bin/locate";
 
+static int const pipe_size = 0x100000; /* the default of pipe-max-size */
+
+static int const poll_interval = 10; /* milliseconds */
+
 static int spawn_locate(
-	std::string_view pattern, bool base_name, bool ignore_case, int outfd, int *pid
+	char const *path,
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	int outfd, int *pid
 )
 {
 	int error;
 	
+	char limit_image[std::numeric_limits<std::size_t>::digits10 + 2];
+	*std::to_chars(limit_image, limit_image + sizeof(limit_image) - 1, limit).ptr = '\0';
+	
 	std::size_t pattern_length = pattern.size();
 	char *c_pattern = static_cast<char *>(alloca(pattern_length + 1));
 	std::memcpy(c_pattern, pattern.data(), pattern_length);
@@ -58,7 +102,7 @@ static int spawn_locate(
 	/* argv */
 	char const *argv[9];
 	int argc = 0;
-	argv[argc ++] = locate_path;
+	argv[argc ++] = path;
 	argv[argc ++] = "-0";
 	if(base_name){
 		argv[argc ++] = "-b";
@@ -67,7 +111,7 @@ static int spawn_locate(
 		argv[argc ++] = "-i";
 	}
 	argv[argc ++] = "-l";
-	argv[argc ++] = "1024";
+	argv[argc ++] = limit_image;
 	argv[argc ++] = "--";
 	argv[argc ++] = c_pattern;
 	argv[argc] = nullptr;
@@ -92,96 +136,113 @@ static int spawn_locate(
 	return error;
 }
 
-static int read_0(
-	FILE *in, std::function<int (std::string_view)> f,
-	std::size_t *buffer_capacity, std::size_t *buffer_length, char **buffer_data
-)
-{
-	char c;
-	int r = std::fread(&c, 1, 1, in);
-	if(r != 1){
-		if(std::ferror(in)) return nonzero_errno(errno);
-		if(std::feof(in)) return EOF; /* -1 */
-	}else if(c == '\0'){
-		int error = f(std::string_view(*buffer_data, *buffer_length));
-		if(error != 0) return error;
-		*buffer_length = 0;
-	}else{
-		if(*buffer_length >= *buffer_capacity){
-			char *new_data =
-				static_cast<char *>(std::realloc(*buffer_data, *buffer_capacity * 2));
-			if(new_data == nullptr) return nonzero_errno(errno);
-			*buffer_capacity = malloc_usable_size(new_data);
-			*buffer_data = new_data;
-		}
-		(*buffer_data)[*buffer_length] = c;
-		++ *buffer_length;
-	}
-	return 0;
-}
-
-int locate(
-	std::string_view pattern, bool base_name, bool ignore_case,
-	std::function<int (std::string_view)> f, int *status
+int spawn_locate_command(
+	char const *path,
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_command_t *command
 )
 {
 	int error;
-	int pending_error = 0;
 	
-	/* pipe */
+	/* pipe, both ends are not inherited by the commands spawned by the other
+	   threads, and the dup2 for the child clears it on its copy */
 	int pipefds[2];
-	if(pipe(pipefds) < 0) return nonzero_errno(errno);
-	if((error = set_cloexec(pipefds[0])) != 0) return error;
-	FILE *in = fdopen(pipefds[0], "r");
-	if(in == nullptr){
-		error = nonzero_errno(errno);
-		do_close(pipefds[0]);
-		do_close(pipefds[1]);
-		return error;
-	}
+	if(pipe2(pipefds, O_CLOEXEC) < 0) return nonzero_errno(errno);
+	fcntl(pipefds[0], F_SETPIPE_SZ, pipe_size); /* only a hint */
 	
 	/* spawn */
 	int pid;
 	if(
-		(error = spawn_locate(pattern, base_name, ignore_case, pipefds[1], &pid)) != 0
+		(error =
+			spawn_locate(path, pattern, base_name, ignore_case, limit, pipefds[1], &pid)) != 0
 	){
-		std::fclose(in);
+		do_close(pipefds[0]);
 		do_close(pipefds[1]);
 		return error;
 	}
 	if((error = do_close(pipefds[1])) != 0){
+		do_close(pipefds[0]);
+		int status;
+		do_waitpid(pid, &status, 0);
+		return error;
+	}
+	
+	command->fd = pipefds[0];
+	command->pid = pid;
+	command->pidfd = do_pidfd_open(pid);
+	return 0;
+}
+
+int spawn_locate_command(
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_command_t *command
+)
+{
+	return spawn_locate_command(
+		locate_path, pattern, base_name, ignore_case, limit, command
+	);
+}
+
+int poll_locate_command(locate_command_t const *command)
+{
+	struct pollfd fds[1] = {{command->fd, POLLIN, 0}};
+	int r = poll(fds, 1, poll_interval);
+	if(r < 0){
+		int error = errno;
+		return (error == EINTR) ? ETIMEDOUT : nonzero_errno(error);
+	}
+	return (r == 0) ? ETIMEDOUT : 0;
+}
+
+int wait_locate_command(
+	locate_command_t *command, int pending_error, locate_cancelled_t cancelled,
+	int *status
+)
+{
+	int error;
+	
+	/* closing before waiting, not to block the command writing to the pipe */
+	if((error = do_close(command->fd)) != 0 && pending_error == 0){
 		pending_error = error;
 	}
 	
-	/* read */
-	char *buffer_data = static_cast<char *>(std::malloc(PATH_MAX));
-	if(buffer_data == nullptr){
-		pending_error = nonzero_errno(errno);
-	}else{
-		std::size_t buffer_capacity = malloc_usable_size(buffer_data);
-		std::size_t buffer_length = 0;
-		while(pending_error == 0 && ! std::feof(in)){
-			error = read_0(in, f, &buffer_capacity, &buffer_length, &buffer_data);
-			if(error != 0 && error != EOF){
-				pending_error = error;
-			}
-		}
-		free(buffer_data);
+	bool killed = false;
+	if(pending_error != 0){
+		kill_command(command);
+		killed = true;
 	}
 	
 	/* wait */
-	do{
-		if((error = do_waitpid(pid, status, 0)) != 0){
-			std::fclose(in);
+	for(;;){
+		if(command->pidfd >= 0 && ! killed){
+			struct pollfd fds[1] = {{command->pidfd, POLLIN, 0}};
+			int r = poll(fds, 1, poll_interval);
+			if(r < 0 && errno != EINTR){
+				pending_error = nonzero_errno(errno);
+				kill_command(command);
+				killed = true;
+			}else if(r <= 0){
+				if(cancelled()){
+					kill_command(command);
+					killed = true;
+				}
+				continue;
+			}
+		}
+		if((error = do_waitpid(command->pid, status, 0)) != 0){
+			if(command->pidfd >= 0) do_close(command->pidfd);
 			return error;
 		}
-	}while(! WIFEXITED(*status) && ! WIFSIGNALED(*status));
-	if(std::fclose(in) < 0) return nonzero_errno(errno);
+		if(WIFEXITED(*status) || WIFSIGNALED(*status)) break;
+	}
+	if(command->pidfd >= 0) do_close(command->pidfd);
+	if(pending_error != 0) return pending_error;
+	if(killed) return 0; /* cancelled after reading all */
 	if((WIFEXITED(*status) && WEXITSTATUS(*status) != 0) || WIFSIGNALED(*status)){
 		return ELOCATE_FAILURE;
 	}
 	
-	return pending_error;
+	return 0;
 }
 
 static int do_stat(char const *path, struct stat *buf)
@@ -197,15 +258,403 @@ static char const plocate_db[] = "/var/lib/plocate/plocate.db"; /* plocate */
 static char const mlocate_db[] = "/var/lib/mlocate/mlocate.db"; /* mlocate */
 static char const slocate_db[] = "/var/lib/slocate/slocate.db"; /* Findutils */
 
+/* the database that the installed locate uses */
+static int find_database(char const **path, struct stat *statbuf)
+{
+	int error;
+	*path = plocate_db;
+	if((error = do_stat(*path, statbuf)) != 0){
+		*path = mlocate_db;
+		if((error = do_stat(*path, statbuf)) != 0){
+			*path = slocate_db;
+			if((error = do_stat(*path, statbuf)) != 0) return error;
+		}
+	}
+	return 0;
+}
+
+/* whether it should be retried by the command */
+static bool unreadable_database(int error)
+{
+	return error == EUNSUPPORTED_DATABASE || error == EACCES || error == EPERM
+		|| error == ENOENT;
+}
+
+int locate_in_process(
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled, int *status
+)
+{
+	char const *db_path;
+	struct stat statbuf;
+	if(find_database(&db_path, &statbuf) != 0) return EUNSUPPORTED_DATABASE;
+	
+	locate_pattern_t compiled;
+	compile_locate_pattern(pattern, base_name, ignore_case, &compiled);
+	int error;
+	if(db_path == plocate_db){
+		error = plocate_locate(db_path, &compiled, limit, f, cancelled);
+	}else if(db_path == mlocate_db){
+		error = mlocate_locate(db_path, &compiled, limit, f, cancelled);
+	}else{
+		error = slocate_locate(db_path, &compiled, limit, f, cancelled);
+	}
+	if(unreadable_database(error)) return EUNSUPPORTED_DATABASE;
+	*status = 0;
+	return error;
+}
+
 int locate_mtime(std::time_t *mtime)
 {
+	char const *db_path;
 	struct stat statbuf;
 	int error;
-	if((error = do_stat(plocate_db, &statbuf)) != 0){
-		if((error = do_stat(mlocate_db, &statbuf)) != 0){
-			if((error = do_stat(slocate_db, &statbuf)) != 0) return error;
+	if((error = find_database(&db_path, &statbuf)) != 0) return error;
+	*mtime = statbuf.st_mtime;
+	return 0;
+}
+
+/* watch */
+
+static char const * const database_directories[][2] = {
+	{"/var/lib/plocate", "plocate.db"},
+	{"/var/lib/mlocate", "mlocate.db"},
+	{"/var/lib/slocate", "slocate.db"}
+};
+
+/* updatedb writes a temporary file and renames it */
+static std::uint32_t const watch_mask = IN_MOVED_TO | IN_CLOSE_WRITE;
+
+static void run_locate_watch(int fd, int stop_fd, std::function<void ()> f)
+{
+	alignas(struct inotify_event) char buffer[4096];
+	for(;;){
+		struct pollfd fds[2] = {{fd, POLLIN, 0}, {stop_fd, POLLIN, 0}};
+		if(poll(fds, 2, -1) < 0){
+			if(errno == EINTR) continue;
+			break;
+		}
+		if(fds[1].revents != 0) break;
+		ssize_t r = read(fd, buffer, sizeof(buffer));
+		if(r < 0){
+			if(errno == EINTR || errno == EAGAIN) continue;
+			break;
 		}
+		bool modified = false;
+		for(char const *p = buffer; p < buffer + r; ){
+			struct inotify_event const *event = reinterpret_cast<struct inotify_event const *>(p);
+			if(event->len > 0 && (event->mask & watch_mask) != 0){
+				for(std::size_t i = 0; i < std::size(database_directories); ++ i){
+					if(std::strcmp(event->name, database_directories[i][1]) == 0){
+						modified = true;
+					}
+				}
+			}
+			p += sizeof(struct inotify_event) + event->len;
+		}
+		if(modified) f(); /* once for the events read at once */
+	}
+}
+
+int start_locate_watch(std::function<void ()> f, locate_watch_t *watch)
+{
+	int fd = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+	if(fd < 0) return nonzero_errno(errno);
+	int error = ENOENT;
+	for(std::size_t i = 0; i < std::size(database_directories); ++ i){
+		if(inotify_add_watch(fd, database_directories[i][0], watch_mask | IN_ONLYDIR) >= 0){
+			error = 0;
+		}
+	}
+	if(error != 0){
+		do_close(fd);
+		return error;
+	}
+	int stop_fd = eventfd(0, EFD_CLOEXEC);
+	if(stop_fd < 0){
+		error = nonzero_errno(errno);
+		do_close(fd);
+		return error;
+	}
+	try{
+		watch->thread = std::thread(run_locate_watch, fd, stop_fd, std::move(f));
+	}catch(std::system_error const &e){
+		do_close(stop_fd);
+		do_close(fd);
+		return nonzero_errno(e.code().value());
+	}
+	watch->fd = fd;
+	watch->stop_fd = stop_fd;
+	return 0;
+}
+
+void stop_locate_watch(locate_watch_t *watch)
+{
+	std::uint64_t one = 1;
+	while(write(watch->stop_fd, &one, sizeof(one)) < 0 && errno == EINTR);
+	watch->thread.join();
+	do_close(watch->stop_fd);
+	do_close(watch->fd);
+}
+
+/* helper */
+
+/* request: uint32 length of pattern, uint8 base name, uint8 ignore case,
+     2 bytes padding, uint64 limit, pattern (native byte order)
+   reply: records of {tag, path, NUL} for each result,
+     the tag is 'u', 'o', or 'd' by locate_type_t,
+     and {'e', the error in decimal, NUL} at the end */
+
+static std::size_t const helper_request_size = 16;
+static std::size_t const helper_max_pattern = 0x10000;
+static std::size_t const helper_block_size = 0x10000;
+
+static char const helper_tags[] = {'u', 'o', 'd'};
+
+static int send_all(int fd, char const *data, std::size_t size)
+{
+	while(size > 0){
+		ssize_t r = send(fd, data, size, MSG_NOSIGNAL);
+		if(r < 0){
+			int error;
+			if((error = errno) != EINTR) return nonzero_errno(error);
+			continue;
+		}
+		data += r;
+		size -= r;
+	}
+	return 0;
+}
+
+/* *eof is set if it is closed before any byte */
+static int read_all(int fd, char *data, std::size_t size, bool *eof)
+{
+	*eof = false;
+	std::size_t done = 0;
+	while(done < size){
+		ssize_t r = read(fd, data + done, size - done);
+		if(r < 0){
+			int error;
+			if((error = errno) != EINTR) return nonzero_errno(error);
+			continue;
+		}else if(r == 0){
+			*eof = done == 0;
+			return EPIPE;
+		}
+		done += r;
 	}
-	*mtime = statbuf.st_mtime;
 	return 0;
 }
+
+int start_locate_helper(char const *path, locate_helper_t *helper)
+{
+	int error;
+	
+	int fds[2];
+	if(socketpair(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0, fds) < 0){
+		return nonzero_errno(errno);
+	}
+	
+	/* the socket is stdin and stdout of the helper */
+	posix_spawn_file_actions_t file_actions;
+	if((error = posix_spawn_file_actions_init(&file_actions)) != 0){
+		do_close(fds[0]);
+		do_close(fds[1]);
+		return error;
+	}
+	if(
+		(error = posix_spawn_file_actions_adddup2(&file_actions, fds[1], 0)) != 0
+		|| (error = posix_spawn_file_actions_adddup2(&file_actions, fds[1], 1)) != 0
+	){
+		posix_spawn_file_actions_destroy(&file_actions);
+		do_close(fds[0]);
+		do_close(fds[1]);
+		return error;
+	}
+	char const *argv[2] = {path, nullptr};
+	int pid;
+	error =
+		posix_spawn(
+			&pid, path, &file_actions, nullptr, const_cast<char * const *>(argv), environ
+		);
+	posix_spawn_file_actions_destroy(&file_actions);
+	do_close(fds[1]);
+	if(error != 0){
+		do_close(fds[0]);
+		return error;
+	}
+	
+	helper->fd = fds[0];
+	helper->pid = pid;
+	helper->next_ticket = 0;
+	helper->serving = 0;
+	helper->broken = false;
+	helper->pending.clear();
+	return 0;
+}
+
+void stop_locate_helper(locate_helper_t *helper)
+{
+	do_close(helper->fd); /* the helper exits at EOF */
+	int status;
+	do_waitpid(helper->pid, &status, 0);
+}
+
+/* reading the reply for the request of the current ticket,
+   *broken is set if the stream can not be continued */
+static int read_helper_reply(
+	locate_helper_t *helper, locate_callback_t f, locate_cancelled_t cancelled,
+	bool *broken
+)
+{
+	std::string *buffer = &helper->pending;
+	int result = 0; /* from f or cancelled */
+	char block[helper_block_size];
+	for(;;){
+		std::size_t p = 0;
+		std::size_t nul;
+		while((nul = buffer->find('\0', p)) != std::string::npos){
+			std::string_view record(buffer->data() + p, nul - p);
+			p = nul + 1;
+			if(record.empty()){
+				*broken = true;
+				return EPROTO;
+			}
+			char tag = record[0];
+			record.remove_prefix(1);
+			if(tag == 'e'){
+				int error = 0;
+				std::from_chars_result r =
+					std::from_chars(record.data(), record.data() + record.size(), error);
+				buffer->erase(0, p);
+				if(r.ec != std::errc() || r.ptr != record.data() + record.size()){
+					*broken = true;
+					return EPROTO;
+				}
+				return (result != 0) ? result : error;
+			}
+			if(result != 0) continue; /* only reading the rest */
+			if(cancelled()){
+				result = ECANCELED;
+				continue;
+			}
+			locate_type_t type = lrt_unknown;
+			for(std::size_t i = 0; i < std::size(helper_tags); ++ i){
+				if(tag == helper_tags[i]) type = static_cast<locate_type_t>(i);
+			}
+			result = f(record, type);
+		}
+		buffer->erase(0, p);
+		ssize_t r = read(helper->fd, block, sizeof(block));
+		if(r < 0){
+			int error;
+			if((error = errno) == EINTR) continue;
+			*broken = true;
+			return nonzero_errno(error);
+		}else if(r == 0){
+			*broken = true;
+			return EPIPE;
+		}
+		buffer->append(block, r);
+	}
+}
+
+bool locate_helper_broken(locate_helper_t *helper)
+{
+	std::lock_guard<std::mutex> lock(helper->mutex);
+	return helper->broken;
+}
+
+int locate_by_helper(
+	locate_helper_t *helper,
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+)
+{
+	if(pattern.size() > helper_max_pattern) return ENAMETOOLONG;
+	
+	std::string request(helper_request_size, '\0');
+	std::uint32_t length = pattern.size();
+	std::uint64_t limit_64 = limit;
+	std::memcpy(request.data(), &length, sizeof(length));
+	request[4] = base_name;
+	request[5] = ignore_case;
+	std::memcpy(request.data() + 8, &limit_64, sizeof(limit_64));
+	request.append(pattern);
+	
+	std::unique_lock<std::mutex> lock(helper->mutex);
+	if(helper->broken) return EPIPE;
+	int error = send_all(helper->fd, request.data(), request.size());
+	if(error != 0){
+		helper->broken = true;
+		helper->condition.notify_all();
+		return EPIPE;
+	}
+	std::uint64_t ticket = helper->next_ticket ++;
+	while(helper->serving != ticket && ! helper->broken){
+		helper->condition.wait(lock);
+	}
+	if(helper->broken) return EPIPE;
+	lock.unlock();
+	
+	/* only this thread reads until serving is incremented */
+	bool broken = false;
+	error = read_helper_reply(helper, f, cancelled, &broken);
+	
+	lock.lock();
+	++ helper->serving;
+	if(broken){
+		helper->broken = true;
+		error = EPIPE;
+	}
+	helper->condition.notify_all();
+	return error;
+}
+
+int serve_locate_helper(int fd)
+{
+	std::string reply;
+	std::string pattern;
+	for(;;){
+		char header[helper_request_size];
+		bool eof;
+		int error = read_all(fd, header, helper_request_size, &eof);
+		if(eof) return 0;
+		if(error != 0) return error;
+		std::uint32_t length;
+		std::uint64_t limit;
+		std::memcpy(&length, header, sizeof(length));
+		std::memcpy(&limit, header + 8, sizeof(limit));
+		bool base_name = header[4] != 0;
+		bool ignore_case = header[5] != 0;
+		if(length > helper_max_pattern) return EPROTO;
+		pattern.resize(length);
+		if((error = read_all(fd, pattern.data(), length, &eof)) != 0) return error;
+		
+		reply.clear();
+		int write_error = 0;
+		auto f = [fd, &reply, &write_error](std::string_view item, locate_type_t type){
+			reply.push_back(helper_tags[type]);
+			reply.append(item);
+			reply.push_back('\0');
+			if(reply.size() >= helper_block_size){
+				if((write_error = send_all(fd, reply.data(), reply.size())) != 0){
+					return write_error;
+				}
+				reply.clear();
+			}
+			return 0;
+		};
+		int status;
+		error = locate(pattern, base_name, ignore_case, limit, f, &status);
+		if(write_error != 0) return write_error;
+		
+		char error_image[std::numeric_limits<int>::digits10 + 2];
+		char *error_end =
+			std::to_chars(error_image, error_image + sizeof(error_image), error).ptr;
+		reply.push_back('e');
+		reply.append(error_image, error_end - error_image);
+		reply.push_back('\0');
+		if((error = send_all(fd, reply.data(), reply.size())) != 0) return error;
+	}
+}
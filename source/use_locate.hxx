@@ -1,24 +1,281 @@
 #ifndef USE_LOCATE_HXX
 #define USE_LOCATE_HXX
 
+#include "trace.hxx"
+
+#include <cerrno>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdlib>
+#include <cstring>
 #include <ctime>
 #include <functional>
+#include <mutex>
+#include <string>
 #include <string_view>
+#include <thread>
+#include <type_traits>
+
+#include <unistd.h>
 
 #define EUNKNOWNERROR 0x10001
 #define ELOCATE_FAILURE 0x10002
+#define EUNSUPPORTED_DATABASE 0x10003
+#define ELOCATE_STOPPED 0x10004 /* returned from f to stop, not an error */
+
+/* the default maximum number of the results (-l),
+   more results mean that the list is incomplete */
+inline constexpr std::size_t default_locate_limit = 1024;
 
 inline int nonzero_errno(int error)
 {
 	return (error == 0) ? EUNKNOWNERROR : error;
 }
 
-int locate(
-	std::string_view pattern, bool base_name, bool ignore_case,
-	std::function<int (std::string_view)> f,
+/* the type of a result, if the database records it (only mlocate.db) */
+enum locate_type_t : unsigned char {lrt_unknown, lrt_other, lrt_directory};
+
+/* references to callbacks, for the parts that are not templates */
+
+struct locate_callback_t {
+	int (*invoke)(void *closure, std::string_view item, locate_type_t type);
+	void *closure;
+	
+	int operator () (std::string_view item, locate_type_t type = lrt_unknown) const
+	{
+		return this->invoke(this->closure, item, type);
+	}
+};
+
+/* f(item, type), or f(item) if it ignores the type */
+template<class F>
+locate_callback_t make_locate_callback(F &f)
+{
+	return locate_callback_t{
+		[](void *closure, std::string_view item, [[maybe_unused]] locate_type_t type){
+			if constexpr(std::is_invocable_v<F &, std::string_view, locate_type_t>){
+				return (*static_cast<F *>(closure))(item, type);
+			}else{
+				return (*static_cast<F *>(closure))(item);
+			}
+		},
+		&f
+	};
+}
+
+/* polled while locating, true means the results are no longer needed */
+struct locate_cancelled_t {
+	bool (*invoke)(void *closure);
+	void *closure;
+	
+	bool operator () () const
+	{
+		return this->invoke(this->closure);
+	}
+};
+
+template<class C>
+locate_cancelled_t make_locate_cancelled(C &cancelled)
+{
+	return locate_cancelled_t{
+		[](void *closure){
+			return (*static_cast<C *>(closure))();
+		},
+		&cancelled
+	};
+}
+
+/* reading the database directly,
+   returns EUNSUPPORTED_DATABASE if it should be done by the command */
+int locate_in_process(
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled, int *status
+);
+
+/* the command */
+
+struct locate_command_t {
+	int fd;
+	int pid;
+	int pidfd; /* -1 if pidfd_open is not supported */
+};
+
+int spawn_locate_command(
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_command_t *command
+);
+
+/* running path instead of /usr/bin/locate, with the same arguments */
+int spawn_locate_command(
+	char const *path,
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_command_t *command
+);
+
+/* waiting the output for the interval of polling cancelled,
+   returns ETIMEDOUT if nothing comes */
+int poll_locate_command(locate_command_t const *command);
+
+/* killing the command if pending_error is not 0 or cancelled,
+   a run cancelled after reading all output is not an error */
+int wait_locate_command(
+	locate_command_t *command, int pending_error, locate_cancelled_t cancelled,
 	int *status /* when the return value is ELOCATE_FAILURE */
 );
 
+/* splitting the output at NUL by blocks, without copying each record,
+   f(item, type) or f(item) is called directly so it can be inlined */
+template<class F, class C>
+int read_0(locate_command_t const *command, F &f, C &cancelled)
+{
+	int const fd = command->fd;
+	std::size_t const block_size = 0x40000;
+	
+	std::size_t capacity = block_size;
+	char *buffer = static_cast<char *>(std::malloc(capacity));
+	if(buffer == nullptr) return nonzero_errno(errno);
+	std::size_t length = 0; /* a record straddling the blocks */
+	int error = 0;
+	for(;;){
+		if(cancelled()){
+			error = ECANCELED;
+			break;
+		}
+		if((error = poll_locate_command(command)) != 0){
+			if(error == ETIMEDOUT){
+				error = 0;
+				continue;
+			}
+			break;
+		}
+		ssize_t r = read(fd, buffer + length, capacity - length);
+		if(r < 0){
+			if(errno == EINTR) continue;
+			error = nonzero_errno(errno);
+			break;
+		}else if(r == 0){
+			break; /* EOF, an unterminated record is dropped */
+		}
+		char const *p = buffer;
+		char const *end = buffer + length + r;
+		char const *nul;
+		while((nul = static_cast<char const *>(std::memchr(p, '\0', end - p))) != nullptr){
+			std::string_view item(p, nul - p);
+			if constexpr(std::is_invocable_v<F &, std::string_view, locate_type_t>){
+				error = f(item, lrt_unknown); /* not known from the output */
+			}else{
+				error = f(item);
+			}
+			if(error != 0) break;
+			p = nul + 1;
+		}
+		if(error != 0) break;
+		length = end - p;
+		if(length > 0 && p != buffer){
+			std::memmove(buffer, p, length);
+		}
+		if(length == capacity){
+			char *new_buffer = static_cast<char *>(std::realloc(buffer, capacity * 2));
+			if(new_buffer == nullptr){
+				error = nonzero_errno(errno);
+				break;
+			}
+			buffer = new_buffer;
+			capacity *= 2;
+		}
+	}
+	std::free(buffer);
+	return error;
+}
+
+/* returns ECANCELED if cancelled() becomes true before all results come,
+   or the error returned from f (ELOCATE_STOPPED to stop early) */
+template<class F, class C>
+int locate(
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	F &&f, C &&cancelled,
+	int *status /* when the return value is ELOCATE_FAILURE */
+)
+{
+	int error =
+		locate_in_process(
+			pattern, base_name, ignore_case, limit, make_locate_callback(f),
+			make_locate_cancelled(cancelled), status
+		);
+	if(error != EUNSUPPORTED_DATABASE) return error;
+	
+	trace_count(tc_locate_command);
+	std::uint64_t start = trace_begin();
+	locate_command_t command;
+	if(
+		(error =
+			spawn_locate_command(pattern, base_name, ignore_case, limit, &command)) != 0
+	){
+		return error;
+	}
+	trace_end(ts_spawn, start);
+	error = read_0(&command, f, cancelled);
+	return wait_locate_command(
+		&command, error, make_locate_cancelled(cancelled), status
+	);
+}
+
+template<class F>
+int locate(
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	F &&f, int *status /* when the return value is ELOCATE_FAILURE */
+)
+{
+	return locate(
+		pattern, base_name, ignore_case, limit, f, [](){ return false; }, status
+	);
+}
+
 int locate_mtime(std::time_t *mtime);
 
+/* the helper process (krunner_locate_helper), started once and answering
+   the requests over a socket, the requests from the threads are pipelined
+   and the replies come in the same order */
+
+struct locate_helper_t {
+	int fd; /* socket */
+	int pid;
+	std::mutex mutex;
+	std::condition_variable condition;
+	std::uint64_t next_ticket; /* of the next request */
+	std::uint64_t serving; /* the ticket whose reply is read next */
+	bool broken;
+	std::string pending; /* read after the last reply */
+};
+
+int start_locate_helper(char const *path, locate_helper_t *helper);
+void stop_locate_helper(locate_helper_t *helper);
+
+/* true after the helper is lost, it should be started again */
+bool locate_helper_broken(locate_helper_t *helper);
+
+/* same as locate(), returns EPIPE if the helper is lost,
+   the rest of the reply is read even if stopped or cancelled */
+int locate_by_helper(
+	locate_helper_t *helper,
+	std::string_view pattern, bool base_name, bool ignore_case, std::size_t limit,
+	locate_callback_t f, locate_cancelled_t cancelled
+);
+
+/* the loop of the helper, answering on fd until it is closed */
+int serve_locate_helper(int fd);
+
+/* watching the directories of the databases with inotify */
+
+struct locate_watch_t {
+	int fd; /* inotify */
+	int stop_fd; /* eventfd */
+	std::thread thread;
+};
+
+/* f is called from the thread of watch when any database is replaced,
+   returns an error if none of the directories can be watched */
+int start_locate_watch(std::function<void ()> f, locate_watch_t *watch);
+void stop_locate_watch(locate_watch_t *watch);
+
 #endif
@@ -0,0 +1,100 @@
+#include "work_pool.hxx"
+
+#include <algorithm>
+#include <system_error>
+
+work_pool_t::work_pool_t(std::size_t thread_count)
+	: body(nullptr), count(0), next(0), active(0), generation(0), stopping(false)
+{
+	for(std::size_t i = 1; i < thread_count; ++ i){
+		try{
+			this->threads.emplace_back(&work_pool_t::serve, this);
+		}catch(std::system_error const &){
+			break; /* the others do the rest */
+		}
+	}
+}
+
+work_pool_t::~work_pool_t()
+{
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->stopping = true;
+	}
+	this->work_condition.notify_all();
+	for(
+		std::vector<std::thread>::iterator i = this->threads.begin();
+		i != this->threads.end();
+		++ i
+	){
+		i->join();
+	}
+}
+
+std::size_t work_pool_t::thread_count() const
+{
+	return this->threads.size() + 1;
+}
+
+void work_pool_t::work()
+{
+	for(;;){
+		std::size_t i = this->next.fetch_add(1, std::memory_order_relaxed);
+		if(i >= this->count) break;
+		(*this->body)(i);
+	}
+}
+
+void work_pool_t::serve()
+{
+	std::uint64_t seen = 0;
+	std::unique_lock<std::mutex> lock(this->mutex);
+	for(;;){
+		this->work_condition.wait(
+			lock,
+			[this, seen](){
+				return this->stopping || (this->body != nullptr && this->generation != seen);
+			}
+		);
+		if(this->stopping) return;
+		seen = this->generation;
+		++ this->active;
+		lock.unlock();
+		this->work();
+		lock.lock();
+		-- this->active;
+		if(this->active == 0) this->done_condition.notify_one();
+	}
+}
+
+void work_pool_t::run(std::size_t count, std::function<void (std::size_t)> const &body)
+{
+	std::unique_lock<std::mutex> busy(this->run_mutex, std::try_to_lock);
+	if(count <= 1 || this->threads.empty() || ! busy.owns_lock()){
+		for(std::size_t i = 0; i < count; ++ i){
+			body(i);
+		}
+		return;
+	}
+	
+	{
+		std::lock_guard<std::mutex> lock(this->mutex);
+		this->body = &body;
+		this->count = count;
+		this->next.store(0, std::memory_order_relaxed);
+		++ this->generation;
+	}
+	this->work_condition.notify_all();
+	this->work();
+	
+	/* the threads which have not started see body is nullptr */
+	std::unique_lock<std::mutex> lock(this->mutex);
+	this->done_condition.wait(lock, [this](){ return this->active == 0; });
+	this->body = nullptr;
+}
+
+work_pool_t *get_work_pool()
+{
+	static work_pool_t pool(std::clamp<std::size_t>(std::thread::hardware_concurrency(), 1, 8));
+	return &pool;
+}
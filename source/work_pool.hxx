@@ -0,0 +1,51 @@
+#ifndef WORK_POOL_HXX
+#define WORK_POOL_HXX
+
+#include <atomic>
+#include <condition_variable>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+/* a few threads running the chunks of a loop together with the calling
+   thread, each one takes the next chunk when it is done with the last,
+   so a slow chunk does not hold the others */
+
+class work_pool_t {
+	std::mutex run_mutex; /* one loop at a time */
+	std::mutex mutex;
+	std::condition_variable work_condition;
+	std::condition_variable done_condition;
+	std::vector<std::thread> threads;
+	std::function<void (std::size_t)> const *body; /* nullptr if idle */
+	std::size_t count;
+	std::atomic<std::size_t> next;
+	std::size_t active; /* the threads in the loop */
+	std::uint64_t generation;
+	bool stopping;
+	
+	void serve();
+	void work();
+	
+public:
+	/* including the calling thread */
+	explicit work_pool_t(std::size_t thread_count);
+	work_pool_t(work_pool_t const &) = delete;
+	~work_pool_t();
+	
+	work_pool_t &operator = (work_pool_t const &) = delete;
+	
+	std::size_t thread_count() const;
+	
+	/* calling body(i) for each i in [0, count) and returns after all,
+	   only by the calling thread if count is 1 or the pool is busy */
+	void run(std::size_t count, std::function<void (std::size_t)> const &body);
+};
+
+/* shared by the queries, the threads start at the first use */
+work_pool_t *get_work_pool();
+
+#endif